@@ -0,0 +1,317 @@
+#ifndef CHIPPERINO_ANALYZER_H
+#define CHIPPERINO_ANALYZER_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "architecture.hpp"
+#include "opcodes.hpp"
+#include "rom.hpp"
+#include "disassembler.hpp"
+
+/* Static analysis of a loaded ROM. Instead of taking every even address as an instruction like the disassembler
+   does, code is found by following control flow from the entry point: jumps, calls, the two ways out of every
+   skip and the fall through after a call, which is where the callee returns to. Whatever is never reached is
+   data. JP V0, addr goes wherever V0 says at run time, so those are listed as unresolved and not followed.
+
+   The runtime stops the machine as soon as pc goes past the end of the loaded program, so addresses after it
+   are not followed either. Edges that go there are kept, marked as leaving the program */
+
+// What a byte of memory turned out to be, several of these can apply at once
+enum byte_kind_t : uint8_t {
+    BYTE_UNREACHED = 0,
+    BYTE_CODE = 0x1,    // an instruction starts here
+    BYTE_OPERAND = 0x2, // second byte of an instruction
+    BYTE_DATA = 0x4,    // LD I, addr points here
+};
+
+struct basic_block_t {
+    uint16_t start;
+    uint16_t last;          // address of the last instruction
+    chip8_op_t last_op;     // and its handler id
+    uint16_t successors[2]; // where control goes next, in the same function
+    bool leaves_program[2]; // successors[s] is past the end of the program, where the machine stops
+    int nsuccessors;
+    uint16_t callee;        // when last_op is OP_CALL
+    bool writes_memory;     // has an LD B, Vx or LD [I], Vx, so it may modify code
+};
+
+struct rom_analysis_t {
+    uint16_t entry = program_offset;
+    uint16_t program_end = program_offset;
+    uint8_t map[memory_size];                         // byte_kind_t bits for every address
+    std::vector<basic_block_t> blocks;                // sorted by start address
+    std::vector<uint16_t> functions;                  // the entry point and every call target, sorted
+    std::vector<std::pair<uint16_t, uint16_t>> calls; // (function, function it calls), sorted
+    std::vector<uint16_t> unresolved;                 // addresses of JP V0, addr instructions
+};
+
+bool analysis_in_program(const rom_analysis_t *a, uint32_t addr)
+{
+    return addr < a->program_end && addr + 1 < memory_size;
+}
+
+chip8_instruction_t instruction_at(const chip8_t *c, uint16_t addr)
+{
+    return { { { c->raw_memory[addr], c->raw_memory[addr + 1] } } };
+}
+
+/* Where control goes after the instruction at addr, other than into a callee, and which of those places are
+   past the end of the program. Returns false if the next instruction does not simply follow, which ends a basic
+   block */
+bool instruction_flow(const rom_analysis_t *a, uint16_t addr, chip8_op_t op, uint16_t nnn, uint16_t out[2],
+                      bool leaves[2], int *n)
+{
+    uint16_t targets[2];
+    int count = 0;
+    bool falls_through = false;
+
+    switch (op)
+    {
+    case OP_SYS: case OP_JP:
+        targets[count++] = nnn;
+        break;
+    case OP_CALL:
+        targets[count++] = addr + 2;
+        break;
+    case OP_SE_BYTE: case OP_SNE_BYTE: case OP_SE_REG: case OP_SNE_REG: case OP_SKP: case OP_SKNP:
+        targets[count++] = addr + 2;
+        targets[count++] = addr + 4;
+        break;
+    case OP_RET: case OP_JP_V0:
+        break;
+    default:
+        targets[count++] = addr + 2;
+        falls_through = true;
+        break;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        out[i] = targets[i];
+        leaves[i] = !analysis_in_program(a, targets[i]);
+    }
+    *n = count;
+    return falls_through;
+}
+
+// The basic block starting at addr, or NULL if none does
+const basic_block_t *find_block(const rom_analysis_t *a, uint16_t addr)
+{
+    auto it = std::lower_bound(a->blocks.begin(), a->blocks.end(), addr,
+                               [](const basic_block_t &b, uint16_t addr) { return b.start < addr; });
+    if (it == a->blocks.end() || it->start != addr)
+        return NULL;
+    return &*it;
+}
+
+void analyze(const chip8_t *c, rom_analysis_t *a)
+{
+    a->program_end = program_offset + c->program_size;
+    memset(a->map, BYTE_UNREACHED, sizeof(a->map));
+    a->blocks.clear();
+    a->functions.clear();
+    a->calls.clear();
+    a->unresolved.clear();
+
+    std::vector<bool> leader(memory_size);
+    std::vector<uint16_t> work;
+    auto follow = [&](uint16_t target) {
+        leader[target] = true;
+        work.push_back(target);
+    };
+    if (!analysis_in_program(a, a->entry))
+        return;
+    follow(a->entry);
+    a->functions.push_back(a->entry);
+
+    // Find every reachable instruction, and the ones basic blocks have to start at
+    while (!work.empty())
+    {
+        uint16_t addr = work.back();
+        work.pop_back();
+
+        while (analysis_in_program(a, addr))
+        {
+            if (a->map[addr] & BYTE_CODE)
+            {
+                // running into code found earlier, which now has a second way in
+                leader[addr] = true;
+                break;
+            }
+            a->map[addr] |= BYTE_CODE;
+            a->map[addr + 1] |= BYTE_OPERAND;
+
+            chip8_instruction_t i = instruction_at(c, addr);
+            const opcode_t *o = find_opcode(instruction_word(i));
+            uint16_t nnn = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
+            if (o->op == OP_LD_I)
+                a->map[nnn] |= BYTE_DATA;
+            if (o->op == OP_JP_V0)
+                a->unresolved.push_back(addr);
+            if (o->op == OP_CALL && analysis_in_program(a, nnn))
+            {
+                a->functions.push_back(nnn);
+                follow(nnn);
+            }
+
+            uint16_t next[2];
+            bool leaves[2];
+            int n;
+            if (instruction_flow(a, addr, o->op, nnn, next, leaves, &n))
+            {
+                addr += 2;
+                continue;
+            }
+            for (int j = 0; j < n; ++j)
+                if (!leaves[j])
+                    follow(next[j]);
+            break;
+        }
+    }
+
+    // Cut the code into basic blocks
+    for (uint32_t start = 0; start < memory_size; ++start)
+    {
+        if (!leader[start] || !(a->map[start] & BYTE_CODE))
+            continue;
+
+        basic_block_t b = {};
+        b.start = start;
+        uint16_t addr = start;
+        for (;;)
+        {
+            chip8_instruction_t i = instruction_at(c, addr);
+            b.last = addr;
+            b.last_op = find_opcode(instruction_word(i))->op;
+            b.writes_memory |= b.last_op == OP_LD_B_VX || b.last_op == OP_LD_MEM_VX;
+            if (b.last_op == OP_CALL)
+                b.callee = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
+
+            bool falls_through = instruction_flow(a, addr, b.last_op, (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb,
+                                                  b.successors, b.leaves_program, &b.nsuccessors);
+            // a block also ends right before the next one starts, or the end of the program
+            if (!falls_through || b.leaves_program[0] || leader[b.successors[0]])
+                break;
+            addr += 2;
+        }
+        a->blocks.push_back(b);
+    }
+
+    std::sort(a->functions.begin(), a->functions.end());
+    a->functions.erase(std::unique(a->functions.begin(), a->functions.end()), a->functions.end());
+    std::sort(a->unresolved.begin(), a->unresolved.end());
+
+    // Call graph: the calls made from the blocks each function reaches before returning
+    std::vector<uint16_t> seen(memory_size, 0xFFFF);
+    for (uint16_t f : a->functions)
+    {
+        work.assign(1, f);
+        while (!work.empty())
+        {
+            uint16_t addr = work.back();
+            work.pop_back();
+            if (seen[addr] == f)
+                continue;
+            seen[addr] = f;
+
+            const basic_block_t *b = find_block(a, addr);
+            if (!b)
+                continue;
+            if (b->last_op == OP_CALL && analysis_in_program(a, b->callee))
+                a->calls.push_back({ f, b->callee });
+            for (int s = 0; s < b->nsuccessors; ++s)
+                if (!b->leaves_program[s])
+                    work.push_back(b->successors[s]);
+        }
+    }
+    std::sort(a->calls.begin(), a->calls.end());
+    a->calls.erase(std::unique(a->calls.begin(), a->calls.end()), a->calls.end());
+}
+
+/** Analysis report **/
+
+char byte_kind_glyph(uint8_t kind)
+{
+    if ((kind & BYTE_CODE) && (kind & BYTE_OPERAND))
+        return 'X'; // overlapping instructions
+    if (kind & BYTE_CODE)
+        return 'C';
+    if (kind & BYTE_OPERAND)
+        return 'c';
+    if (kind & BYTE_DATA)
+        return 'D';
+    return '.';
+}
+
+void analyze(char *filename)
+{
+    chip8_t *c = new chip8_t();
+    if (load_rom(c, filename) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        delete c;
+        return;
+    }
+    rom_analysis_t *a = new rom_analysis_t();
+    analyze(c, a);
+
+    int code = 0, data = 0;
+    for (uint16_t addr = program_offset; addr < a->program_end; ++addr)
+    {
+        code += (a->map[addr] & (BYTE_CODE | BYTE_OPERAND)) != 0;
+        data += !(a->map[addr] & (BYTE_CODE | BYTE_OPERAND));
+    }
+
+    printf("Analysis:\n================\n");
+    printf("%zu functions, %zu basic blocks, %d bytes of code, %d bytes of data\n", a->functions.size(),
+           a->blocks.size(), code, data);
+
+    printf("\nBasic blocks:\n");
+    for (const basic_block_t &b : a->blocks)
+    {
+        printf("%x-%x", b.start, b.last + 1);
+        for (int i = 0; i < b.nsuccessors; ++i)
+            printf("%s%x%s", i ? ", " : " -> ", b.successors[i], b.leaves_program[i] ? " (leaves the program)" : "");
+        if (b.last_op == OP_CALL)
+            printf(" (calls %x)", b.callee);
+        if (b.last_op == OP_JP_V0)
+            printf(" (unresolved)");
+        printf("\n");
+        for (uint16_t addr = b.start; addr <= b.last; addr += 2)
+            print_instruction(instruction_at(c, addr), addr);
+    }
+
+    printf("\nCall graph:\n");
+    for (uint16_t f : a->functions)
+    {
+        printf("%x:", f);
+        auto it = std::lower_bound(a->calls.begin(), a->calls.end(), std::make_pair(f, (uint16_t)0));
+        for (; it != a->calls.end() && it->first == f; ++it)
+            printf(" %x", it->second);
+        printf("\n");
+    }
+
+    printf("\nUnresolved jumps:\n");
+    for (uint16_t addr : a->unresolved)
+        print_instruction(instruction_at(c, addr), addr);
+
+    printf("\nMemory map (C instruction, c operand, X both, D data loaded into I, . never reached):\n");
+    for (uint32_t line = program_offset; line < a->program_end; line += 64)
+    {
+        printf("%x\t", line);
+        for (uint32_t addr = line; addr < line + 64 && addr < a->program_end; ++addr)
+            putchar(byte_kind_glyph(a->map[addr]));
+        printf("\n");
+    }
+    printf("================\nend of analysis\n");
+
+    delete a;
+    delete c;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef CHIPPERINO_AOT_H
+#define CHIPPERINO_AOT_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "runtime.cpp"
+#include "batch.hpp"
+
+/* Support for the C++ files chipperino -c writes: every one of them includes this header and nothing else, and
+   is built like main.cpp, e.g.
+
+       c++ -std=c++17 -O2 -I<chipperino sources> pong.cpp -o pong -lpthread
+
+   A translated ROM is an engine like any other, run by the same runtime, so input, timers and the display
+   work exactly as under chipperino -e. Its blocks are only valid while memory still holds the bytes they were
+   translated from. To notice when it does not, the instructions of every block are kept in the decode cache:
+   writing over any of them moves the machine's code epoch, the same way it does for the JIT, and then the
+   blocks are checked against the original program again. Blocks that changed are interpreted from then on */
+
+struct aot_program_t {
+    const char *name;               // of the ROM this was translated from
+    const uint8_t *program;         // the ROM itself
+    uint16_t program_size;
+    const uint16_t (*blocks)[2];    // start and end (exclusive) of every translated block
+    uint16_t nblocks;
+};
+
+struct aot_context_t {
+    uint32_t code_epoch = 0;        // chip8_t::code_epoch the stale flags below were computed for
+    std::vector<bool> stale;        // blocks whose bytes are not the ones translated any more
+};
+
+aot_context_t aot_context;
+
+// Find the blocks of p that c has written over, and watch the rest for writes from now on
+void aot_sync(chip8_t *c, const aot_program_t *p)
+{
+    aot_context.stale.resize(p->nblocks);
+    for (uint16_t i = 0; i < p->nblocks; ++i)
+    {
+        uint16_t start = p->blocks[i][0], end = p->blocks[i][1];
+        aot_context.stale[i] = memcmp(&c->raw_memory[start], &p->program[start - program_offset], end - start);
+        for (uint16_t addr = start; addr < end; addr += 2)
+            fetch_decoded(c, addr);
+    }
+    aot_context.code_epoch = c->code_epoch;
+}
+
+/* Entry point of a translated ROM. With no arguments it is played on the terminal like chipperino -e,
+   -b runs it headless instead and prints a line like chipperino -b */
+int aot_main(int argc, char *argv[], const aot_program_t *p, engine_f *engine)
+{
+    runtime_config_t config;
+    config.engine = engine;
+    bool batch = false;
+    uint64_t cycles = batch_default_frames * batch_instructions_per_frame;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp("-b", argv[i]))
+            batch = true;
+        else if (!strcmp("-n", argv[i]) && i + 1 < argc)
+            cycles = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp("-f", argv[i]) && i + 1 < argc)
+            cycles = strtoull(argv[++i], NULL, 0) * batch_instructions_per_frame;
+        else if (!strcmp("-p", argv[i]) && i + 1 < argc)
+            config.instructions_per_frame = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp("-u", argv[i]))
+            config.turbo = true;
+        else
+        {
+            fprintf(stderr, "Usage:\n\t%s [-p <instructions per frame>] [-u]\n\t%s -b [-n <cycles> | -f <frames>]\n",
+                    argv[0], argv[0]);
+            fprintf(stderr, "Translated from '%s'\n", p->name);
+            return 1;
+        }
+    }
+
+    chip8_t *c = new chip8_t();
+    load_program(c, p->program, p->program_size);
+    if (!batch)
+    {
+        execute(c, p->name, &config);
+        return 0;
+    }
+
+    batch_result_t result = {};
+    auto start = std::chrono::steady_clock::now();
+    result.loaded = true;
+    run_headless(c, engine, cycles, &result);
+    result.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fill_batch_result(c, &result);
+    print_batch_result(p->name, &result);
+    delete c;
+    return 0;
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <map>
 #include <string>
 #include <cstddef>
+#include <atomic>
 
 /** Memory layout **/
 
@@ -15,9 +16,6 @@ const uint16_t memory_size = 4096;
 // The first 512 B are reserved memory
 const uint16_t program_offset = 512;
 
-// Counter of how many B we read from our ROM
-uint16_t program_size = 0;
-
 // Pixel display limits
 /* TODO: Maybe turn these into cli arguments?
  Normal chip8 is 64x32
@@ -26,6 +24,10 @@ uint16_t program_size = 0;
 const uint8_t chip8_display_width = 64;
 const uint8_t chip8_display_height = 32;
 
+// The display is packed one row per 64b word, and rows wrap around with a mask
+static_assert(chip8_display_width == 64);
+static_assert((chip8_display_height & (chip8_display_height - 1)) == 0);
+
 /** PCG32 random number generator **/
 
 struct pcg32_random_t { uint64_t state;  uint64_t inc; };
@@ -115,6 +117,71 @@ struct chip8_input_t {
 
 static_assert(sizeof(chip8_input_t) == 2);
 
+/** Predecoded instructions **/
+
+/* Handler ids for predecoded instructions.
+   OP_UNDECODED must stay 0 so a zeroed cache means "nothing decoded yet" */
+enum chip8_op_t : uint8_t {
+    OP_UNDECODED = 0,
+    OP_CLS,        // 00E0
+    OP_RET,        // 00EE
+    OP_SYS,        // 0nnn
+    OP_JP,         // 1nnn
+    OP_CALL,       // 2nnn
+    OP_SE_BYTE,    // 3xkk
+    OP_SNE_BYTE,   // 4xkk
+    OP_SE_REG,     // 5xy0
+    OP_LD_BYTE,    // 6xkk
+    OP_ADD_BYTE,   // 7xkk
+    OP_LD_REG,     // 8xy0
+    OP_OR,         // 8xy1
+    OP_AND,        // 8xy2
+    OP_XOR,        // 8xy3
+    OP_ADD_REG,    // 8xy4
+    OP_SUB,        // 8xy5
+    OP_SHR,        // 8xy6
+    OP_SUBN,       // 8xy7
+    OP_SHL,        // 8xyE
+    OP_SNE_REG,    // 9xy0
+    OP_LD_I,       // Annn
+    OP_JP_V0,      // Bnnn
+    OP_RND,        // Cxkk
+    OP_DRW,        // Dxyn
+    OP_SKP,        // Ex9E
+    OP_SKNP,       // ExA1
+    OP_LD_VX_DT,   // Fx07
+    OP_LD_VX_K,    // Fx0A
+    OP_LD_DT_VX,   // Fx15
+    OP_LD_ST_VX,   // Fx18
+    OP_ADD_I_VX,   // Fx1E
+    OP_LD_F_VX,    // Fx29
+    OP_LD_B_VX,    // Fx33
+    OP_LD_MEM_VX,  // Fx55
+    OP_LD_VX_MEM,  // Fx65
+    OP_ERROR,      // anything we do not recognise, executed as a no-op
+    OP_COUNT
+};
+
+// An instruction with all of its operands already extracted
+struct chip8_decoded_t {
+    uint16_t nnn; // lower 12b, for addresses
+    uint8_t op;   // chip8_op_t handler id
+    uint8_t x;    // lower nibble of the msb
+    uint8_t y;    // upper nibble of the lsb
+    uint8_t kk;   // lsb, the lower nibble of which is n
+};
+
+static_assert(sizeof(chip8_decoded_t) == 6);
+
+/* Code epochs are handed out from a single counter so that an epoch identifies both a machine and the version
+   of its code. Anything caching translated code compares epochs instead of watching writes itself */
+std::atomic<uint32_t> code_epoch_counter{0};
+
+uint32_t next_code_epoch()
+{
+    return ++code_epoch_counter;
+}
+
 
 struct chip8_t {
     /* Secondary memory region */
@@ -159,32 +226,43 @@ struct chip8_t {
     uint8_t sp = 0;      // stack pointer
     uint8_t dt = 0;      // delay timer
     uint8_t st = 0;      // sound timer
+    // Emulated time, in instructions run or skipped while idle since power on. The timers tick by it
+    uint64_t cycles = 0;
 
     /* Display */
-    uint8_t display[chip8_display_height][chip8_display_width] = {};
+    // One word per row, pixel x lives in bit (63 - x) so a sprite byte shifted to the top lands on x = 0
+    uint64_t display[chip8_display_height] = {};
 
     /* Input */
     chip8_input_t input = {};
 
     /* Miscelaneous */
     pcg32_random_t rng = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
-    
+    // Counter of how many B we read from our ROM
+    uint16_t program_size = 0;
+    // Signals that the display buffer changed and needs to be redrawn
+    bool display_update = true;
+
+    /* Predecoded instruction cache, one entry per byte address so odd-aligned code hits too.
+       Entries are filled lazily by dispatch() and dropped when the ROM writes over them */
+    chip8_decoded_t decoded[memory_size] = {};
+    // Changes every time the ROM writes over code that was already decoded
+    uint32_t code_epoch = next_code_epoch();
 };
 
 static_assert(offsetof(chip8_t, stack) == sizeof(chip8_memory_t));
 
-
-// Global var representing the CHIP8 currently being emulated
-chip8_t chip8{};
-
-// Global var signaling that the CHIP8 display buffer changed and needs to be redrawn
-bool display_update = true;
-
-uint16_t memory_offset(chip8_instruction_t *i, chip8_t *c = &chip8)
+uint16_t memory_offset(chip8_instruction_t *i, chip8_t *c)
 {
     return (i - &c->memory.as_words[0]) * sizeof(chip8_instruction_t);
 }
 
+// Value of the pixel at (x, y) in the packed display
+bool display_pixel(const chip8_t *c, int x, int y)
+{
+    return (c->display[y] >> (chip8_display_width - 1 - x)) & 1;
+}
+
 // Misc. macros
 
 #define HALF_UPPER_BYTE(b) (b >> 4)
@@ -0,0 +1,286 @@
+#ifndef CHIPPERINO_BATCH_H
+#define CHIPPERINO_BATCH_H
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "rom.hpp"
+#include "pack.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+
+/* Headless batch runner: every ROM runs on its own machine for a fixed budget, with no terminal, no sleeping
+   and no rendering, spread over a pool of worker threads */
+
+// Instructions per 1/60 s frame when running headless, the same ~500 KHz execute() aims for
+const uint32_t batch_instructions_per_frame = 8333;
+// Emulated time each ROM gets when no budget is given, 10 s
+const uint64_t batch_default_frames = 600;
+
+struct batch_result_t {
+    bool loaded;
+    bool halted;   // ended early, at a jump to itself
+    uint64_t cycles;
+    uint64_t frames;
+    double wall_ms;
+    uint64_t display_hash;
+    int8_t regs[16];
+    uint16_t I;
+    uint16_t pc;
+    uint8_t sp;
+    uint8_t dt;
+    uint8_t st;
+};
+
+// A ROM to run: a file, or an entry in a pack when pack is set
+struct batch_rom_t {
+    std::string name;
+    const rom_pack_t *pack;
+    uint32_t index;
+};
+
+struct batch_job_t {
+    std::vector<batch_rom_t> roms;
+    std::vector<batch_result_t> results;
+    std::atomic<size_t> next_rom{0};
+    engine_f *engine;
+    uint64_t cycles; // budget per ROM
+    bool profile;    // run every ROM under the profiler, into the strings below
+    std::vector<std::string> profiles;
+    std::vector<std::string> folded_stacks;
+    const char *trace_filename; // trace every ROM to this with its index appended, if set
+};
+
+// FNV-1a over the display, so runs can be compared without dumping whole frames
+uint64_t display_hash(chip8_t *c)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    // walk the rows a byte at a time from the left edge, so the hash does not depend on host endianness
+    for (int i = 0; i < chip8_display_height; ++i)
+    {
+        for (int shift = chip8_display_width - 8; shift >= 0; shift -= 8)
+        {
+            hash ^= (uint8_t)(c->display[i] >> shift);
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+// Expand directories into the (sorted) files inside them, leave everything else as is
+std::vector<std::string> collect_roms(const std::vector<char *> &paths)
+{
+    std::vector<std::string> roms;
+    for (char *path : paths)
+    {
+        std::error_code error;
+        if (std::filesystem::is_directory(path, error))
+        {
+            std::vector<std::string> found;
+            for (auto &entry : std::filesystem::recursive_directory_iterator(path, error))
+                if (entry.is_regular_file())
+                    found.push_back(entry.path().string());
+            std::sort(found.begin(), found.end());
+            roms.insert(roms.end(), found.begin(), found.end());
+        }
+        else
+        {
+            roms.push_back(path);
+        }
+    }
+    return roms;
+}
+
+/* Run c for the given number of cycles, on the machine's own clock (see advance_clock()). Waiting for DT in a
+   loop or for a key skips straight to the next tick, counting the cycles spinning would have taken, and a
+   machine that halts ends the run early */
+void run_headless(chip8_t *c, engine_f *engine, uint64_t cycles, batch_result_t *result)
+{
+    // same end condition as execute(): leaving the program's memory region
+    while (result->cycles < cycles && c->pc < program_offset + c->program_size)
+    {
+        uint64_t left = std::min<uint64_t>(cycles_to_tick(c, batch_instructions_per_frame), cycles - result->cycles);
+        chip8_idle_t idle = idle_state(c);
+        if (idle == IDLE_HALTED)
+        {
+            result->halted = true;
+            break;
+        }
+        uint32_t ran = idle ? (uint32_t)left : engine(c, (uint32_t)left);
+        result->cycles += ran;
+
+        // runs stop at every tick, so there is at most one in them
+        if (advance_clock(c, ran, batch_instructions_per_frame))
+        {
+            ++result->frames;
+            if (profile_context)
+                profile_frame(profile_context);
+        }
+    }
+}
+
+// Copy the final state of c into result
+void fill_batch_result(chip8_t *c, batch_result_t *result)
+{
+    result->display_hash = display_hash(c);
+    memcpy(result->regs, c->regs, sizeof(result->regs));
+    result->I = c->I;
+    result->pc = c->pc;
+    result->sp = c->sp;
+    result->dt = c->dt;
+    result->st = c->st;
+}
+
+void batch_worker(batch_job_t *job)
+{
+    profile_t *profile = job->profile ? new profile_t() : NULL;
+    engine_f *engine = profile ? run_profiled : job->engine;
+    profile_context = profile;
+    trace_ring_t *trace = job->trace_filename ? new trace_ring_t() : NULL;
+    trace_context = trace;
+
+    size_t n;
+    while ((n = job->next_rom++) < job->roms.size())
+    {
+        batch_result_t *result = &job->results[n];
+        chip8_t *c = new chip8_t();
+        if (profile)
+            start_profile(profile);
+
+        batch_rom_t *rom = &job->roms[n];
+        auto start = std::chrono::steady_clock::now();
+        packed_rom_t packed;
+        if (rom->pack)
+            packed = packed_rom(rom->pack, rom->index);
+        if ((rom->pack ? load_packed_rom(c, &packed) : load_rom(c, rom->name.c_str())) >= 0)
+        {
+            result->loaded = true;
+            std::string trace_filename = trace ? job->trace_filename + ("." + std::to_string(n)) : "";
+            bool traced = trace && !start_trace(trace, trace_filename.c_str());
+            if (trace && !traced)
+                fprintf(stderr, "Could not save the trace to '%s': %s\n", trace_filename.c_str(), strerror(errno));
+            run_headless(c, traced ? run_traced : engine, job->cycles, result);
+            if (traced && stop_trace(trace))
+                fprintf(stderr, "Could not save the trace to '%s': %s\n", trace_filename.c_str(), strerror(errno));
+        }
+        result->wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        fill_batch_result(c, result);
+        if (profile && result->loaded)
+        {
+            format_profile(&job->profiles[n], profile, c, rom->name.c_str());
+            format_folded_stacks(&job->folded_stacks[n], profile, rom->name.c_str());
+        }
+        delete c;
+    }
+
+    profile_context = NULL;
+    delete profile;
+    trace_context = NULL;
+    delete trace;
+}
+
+void print_batch_result(const char *rom, batch_result_t *r)
+{
+    if (!r->loaded)
+    {
+        printf("%s\terror=could not open\n", rom);
+        return;
+    }
+
+    char regs[16*2 + 1];
+    for (int i = 0; i < 16; ++i)
+        sprintf(&regs[i*2], "%02X", (uint8_t)r->regs[i]);
+
+    printf("%s\tcycles=%llu\tframes=%llu\tms=%.3f\tpc=%03X\tI=%03X\tsp=%u\tdt=%u\tst=%u\tV=%s\tdisplay=%016llx\thalted=%d\n",
+           rom, (unsigned long long)r->cycles, (unsigned long long)r->frames, r->wall_ms, r->pc, r->I,
+           r->sp, r->dt, r->st, regs, (unsigned long long)r->display_hash, r->halted);
+}
+
+/* Run every ROM (or directory of ROMs, or pack) in paths for the given number of cycles and print one summary
+   line per ROM, in the order they were given. threads = 0 uses one worker per core. With a profile_filename
+   every ROM is profiled, and their reports and folded stacks saved one after the other like save_profile().
+   With a trace_filename every ROM is traced to a file of its own, named after it with the ROM's index appended */
+void run_batch(const std::vector<char *> &paths, engine_f *engine, uint64_t cycles, unsigned threads = 0,
+               const char *profile_filename = NULL, const char *trace_filename = NULL)
+{
+    batch_job_t job;
+    std::vector<rom_pack_t *> packs;
+    for (char *path : paths)
+    {
+        if (is_pack_file(path))
+        {
+            rom_pack_t *pack = new rom_pack_t();
+            if (open_pack(pack, path))
+            {
+                fprintf(stderr, "Could not open pack '%s': %s\n", path, strerror(errno));
+                delete pack;
+                continue;
+            }
+            packs.push_back(pack);
+            // by name, like the directory the pack was probably made from
+            std::vector<uint32_t> order(pack->count);
+            for (uint32_t i = 0; i < pack->count; ++i)
+                order[i] = i;
+            std::sort(order.begin(), order.end(),
+                      [&](uint32_t a, uint32_t b) { return packed_rom(pack, a).name < packed_rom(pack, b).name; });
+            for (uint32_t i : order)
+                job.roms.push_back({ std::string(path) + ":" + std::string(packed_rom(pack, i).name), pack, i });
+            continue;
+        }
+        for (std::string &rom : collect_roms({ path }))
+            job.roms.push_back({ rom, NULL, 0 });
+    }
+    job.results.resize(job.roms.size());
+    job.engine = engine;
+    job.cycles = cycles;
+    job.profile = profile_filename != NULL;
+    job.profiles.resize(job.roms.size());
+    job.folded_stacks.resize(job.roms.size());
+    job.trace_filename = trace_filename;
+
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(1, job.roms.size()));
+
+    if (trace_filename)
+        start_trace_writer();
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; ++i)
+        pool.emplace_back(batch_worker, &job);
+    for (auto &t : pool)
+        t.join();
+    if (trace_filename)
+        stop_trace_writer();
+
+    for (size_t i = 0; i < job.roms.size(); ++i)
+        print_batch_result(job.roms[i].name.c_str(), &job.results[i]);
+
+    if (profile_filename)
+    {
+        std::string report, folded;
+        for (size_t i = 0; i < job.roms.size(); ++i)
+        {
+            report += job.profiles[i];
+            folded += job.folded_stacks[i];
+        }
+        if (save_profile(profile_filename, report, folded))
+            fprintf(stderr, "Could not save the profile to '%s': %s\n", profile_filename, strerror(errno));
+    }
+
+    for (rom_pack_t *pack : packs)
+    {
+        close_pack(pack);
+        delete pack;
+    }
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include "architecture.hpp"
+#include "utils.hpp"
+#include "dispatch.hpp"
+#include "threaded.hpp"
+#include "jit.hpp"
+#include "screen.hpp"
+#include "scheduler.hpp"
+#include "disassembler.hpp"
+#include <string>
+#include <vector>
+
+/* Microbenchmarks. Every benchmark does a fixed amount of work a few times over and keeps the fastest run, the
+   one the rest of the system disturbed the least. Results go to stdout as JSON so runs from different commits
+   can be compared with a script:
+
+       bench [filter] > before.json
+
+   Only benchmarks whose name contains filter are run */
+
+const int bench_repeats = 5;
+
+struct bench_result_t {
+    std::string name;
+    uint64_t ops;      // operations done per run
+    double ns_per_op;  // of the fastest run
+};
+
+std::vector<bench_result_t> results;
+const char *bench_filter = NULL;
+
+// Keeps the compiler from throwing away work whose result nobody looks at
+volatile uint64_t bench_sink;
+
+// Time fn, which does ops operations per call, and record the fastest of bench_repeats calls
+template <typename F>
+void bench(const std::string &name, uint64_t ops, F fn)
+{
+    if (bench_filter && name.find(bench_filter) == std::string::npos)
+        return;
+
+    fn(); // warm up caches, the decode cache and the JIT
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < bench_repeats; ++i)
+    {
+        int64_t start = monotonic_ns();
+        fn();
+        best = std::min(best, monotonic_ns() - start);
+    }
+    results.push_back({ name, ops, (double)best / ops });
+    fprintf(stderr, "%-32s %10.2f ns/op\n", name.c_str(), (double)best / ops);
+}
+
+// A ROM that repeats the given instructions until the end of its 32 B and then jumps back to 0x200
+void load_loop(chip8_t *c, std::initializer_list<uint16_t> instructions)
+{
+    uint16_t addr = program_offset;
+    while (addr < program_offset + 30)
+    {
+        for (uint16_t i : instructions)
+        {
+            if (addr >= program_offset + 30)
+                break;
+            c->raw_memory[addr++] = i >> 8;
+            c->raw_memory[addr++] = i & 0xFF;
+        }
+    }
+    // JP 0x200
+    c->raw_memory[addr++] = 0x12;
+    c->raw_memory[addr++] = 0x00;
+    c->program_size = addr - program_offset;
+}
+
+/** dispatch() per opcode family **/
+
+struct family_t {
+    const char *name;
+    std::initializer_list<uint16_t> instructions;
+};
+
+void bench_dispatch()
+{
+    const uint64_t n = 1 << 22;
+    // NOTE: registers start at 0 and V1 is set to 1 below, so none of the skips skip over the final jump
+    family_t families[] = {
+        { "ld_add_byte", { 0x6312, 0x7301, 0x6455, 0x74FF } },
+        { "alu",         { 0x8231, 0x8232, 0x8233, 0x8234, 0x8235, 0x8236, 0x8237, 0x823E } },
+        { "skip",        { 0x3001, 0x4000, 0x5010, 0x9000 } },
+        { "call_ret",    { 0x2220 } },
+        { "index",       { 0xA300, 0xF21E, 0xF229 } },
+        { "timers",      { 0xF207, 0xF215, 0xF218 } },
+        { "memory",      { 0xA300, 0xF233, 0xF355, 0xF365 } },
+        { "rnd",         { 0xC2FF } },
+        { "keys",        { 0xE29E, 0xE2A1 } },
+    };
+
+    for (family_t &f : families)
+    {
+        chip8_t *c = new chip8_t();
+        load_loop(c, f.instructions);
+        // 0x220: RET, for call_ret
+        c->raw_memory[0x220] = 0x00;
+        c->raw_memory[0x221] = 0xEE;
+        c->V1 = 1;
+        bench(std::string("dispatch/") + f.name, n, [&]() {
+            for (uint64_t i = 0; i < n; ++i)
+                dispatch(c);
+        });
+        delete c;
+    }
+}
+
+/** Dxyn **/
+
+void bench_drw()
+{
+    const uint64_t n = 1 << 20;
+    chip8_t *c = new chip8_t();
+    c->I = program_offset;
+    for (int i = 0; i < 16; ++i)
+        c->raw_memory[program_offset + i] = 0xA5 ^ (i * 0x11);
+
+    struct { const char *name; uint8_t x, y; } positions[] = {
+        { "aligned", 8, 0 },
+        { "unaligned", 13, 3 },
+        { "wrapping", 60, 28 },
+    };
+    for (int height : { 1, 5, 15 })
+    {
+        for (auto &p : positions)
+        {
+            c->V0 = p.x;
+            c->V1 = p.y;
+            // DRW v0, v1, height
+            chip8_decoded_t d = decode({ { { (uint8_t)0xD0, (uint8_t)(0x10 | height) } } });
+            bench("drw/" + std::to_string(height) + "/" + p.name, n, [&]() {
+                for (uint64_t i = 0; i < n; ++i)
+                    op_drw(c, d);
+                bench_sink = c->display[0];
+            });
+        }
+    }
+    delete c;
+}
+
+/** Terminal frame generation **/
+
+void bench_render()
+{
+    const uint64_t n = 1 << 16;
+    screen_t *s = new screen_t();
+    uint64_t frames[2][chip8_display_height];
+    pcg32_random_t rng = { 42, 54 };
+
+    // every pixel of the display changing, the worst case
+    for (int y = 0; y < chip8_display_height; ++y)
+    {
+        frames[0][y] = ((uint64_t)pcg32_random_r(&rng) << 32) | pcg32_random_r(&rng);
+        frames[1][y] = ~frames[0][y];
+    }
+    bench("render/full", n, [&]() {
+        for (uint64_t i = 0; i < n; ++i)
+            bench_sink = encode_frame(frames[i & 1], s);
+    });
+
+    // the glyphs alone, with every expander this CPU runs
+    for (const glyph_expander_t &g : glyph_expanders)
+    {
+        if (!g.supported)
+            continue;
+        bench(std::string("render/glyphs_") + g.name, n, [&]() {
+            char glyphs[chip8_display_width];
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                for (int y = 0; y < chip8_display_height; ++y)
+                    g.expand(glyphs, frames[i & 1][y]);
+                bench_sink = glyphs[i & (chip8_display_width - 1)];
+            }
+        });
+    }
+
+    // an 8x5 sprite moving one pixel to the right, the usual case
+    memset(frames, 0, sizeof(frames));
+    for (int y = 10; y < 15; ++y)
+    {
+        frames[0][y] = 0xF8ULL << 40;
+        frames[1][y] = 0xF8ULL << 39;
+    }
+    bench("render/sprite", n, [&]() {
+        for (uint64_t i = 0; i < n; ++i)
+            bench_sink = encode_frame(frames[i & 1], s);
+    });
+    delete s;
+}
+
+/** Disassembler **/
+
+void bench_disassemble()
+{
+    const uint64_t n = 1 << 16;
+    bench("disassemble/all_opcodes", n, [&]() {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            chip8_instruction_t instruction = { { { (uint8_t)(i >> 8), (uint8_t)i } } };
+            sum += disassemble(instruction).nparams;
+        }
+        bench_sink = sum;
+    });
+}
+
+/** Whole ROMs **/
+
+void bench_roms()
+{
+    const uint32_t frames = 120;
+    const uint8_t stress[] = {
+        0x60, 0x00, // 0x200: LD v0, 0x00
+        0x61, 0x00, // 0x202: LD v1, 0x00
+        0xC2, 0x0F, // 0x204: RND v2, 0x0F
+        0xF2, 0x29, // 0x206: LD F, v2
+        0x22, 0x20, // 0x208: CALL 0x220
+        0x70, 0x05, // 0x20A: ADD v0, 0x05
+        0x80, 0x24, // 0x20C: ADD v0, v2
+        0x81, 0x03, // 0x20E: XOR v1, v0
+        0x30, 0x3C, // 0x210: SE v0, 0x3C
+        0x12, 0x04, // 0x212: JP 0x204
+        0x12, 0x00, // 0x214: JP 0x200
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0xD0, 0x15, // 0x220: DRW v0, v1, 5
+        0xA3, 0x00, // 0x222: LD I, 0x300
+        0xF2, 0x33, // 0x224: LD B, v2
+        0xF2, 0x65, // 0x226: LD v2, [I]
+        0x00, 0xEE, // 0x228: RET
+    };
+    const uint8_t alu[] = {
+        0x71, 0x01, // 0x200: ADD v1, 0x01
+        0x82, 0x14, // 0x202: ADD v2, v1
+        0x83, 0x23, // 0x204: XOR v3, v2
+        0x84, 0x36, // 0x206: SHR v4, v3
+        0x31, 0x00, // 0x208: SE v1, 0x00
+        0x12, 0x00, // 0x20A: JP 0x200
+        0x12, 0x00, // 0x20C: JP 0x200
+    };
+    struct { const char *name; const uint8_t *program; size_t size; } roms[] = {
+        { "stress", stress, sizeof(stress) },
+        { "alu", alu, sizeof(alu) },
+    };
+    struct { const char *name; engine_f *engine; } engines[] = {
+        { "switch", run_switch },
+        { "threaded", run_threaded },
+        { "jit", run_jit },
+    };
+
+    for (auto &rom : roms)
+    {
+        for (auto &e : engines)
+        {
+            uint64_t executed = 0;
+            chip8_t *c = NULL;
+            bench(std::string("rom/") + rom.name + "/" + e.name, (uint64_t)frames * default_instructions_per_frame,
+                  [&]() {
+                delete c;
+                c = new chip8_t();
+                memcpy(&c->raw_memory[program_offset], rom.program, rom.size);
+                c->program_size = rom.size;
+                executed = 0;
+                for (uint32_t f = 0; f < frames; ++f)
+                    executed += run_frame(c, e.engine, default_instructions_per_frame);
+            });
+            if (c && executed != (uint64_t)frames * default_instructions_per_frame)
+                fprintf(stderr, "rom/%s/%s only ran %llu instructions\n", rom.name, e.name,
+                        (unsigned long long)executed);
+            delete c;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        bench_filter = argv[1];
+
+    bench_dispatch();
+    bench_drw();
+    bench_render();
+    bench_disassemble();
+    bench_roms();
+
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        bench_result_t *r = &results[i];
+        printf("    { \"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f }%s\n",
+               r->name.c_str(), (unsigned long long)r->ops, r->ns_per_op, 1e9 / r->ns_per_op,
+               i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <new>
+#include "chipperino.h"
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "threaded.hpp"
+#include "jit.hpp"
+#include "rom.hpp"
+#include "scheduler.hpp"
+
+static_assert(CHIPPERINO_DISPLAY_WIDTH == chip8_display_width);
+static_assert(CHIPPERINO_DISPLAY_HEIGHT == chip8_display_height);
+static_assert(CHIPPERINO_DEFAULT_CYCLES_PER_TICK == default_instructions_per_frame);
+
+struct chipperino {
+    chip8_t machine;
+    engine_f *engine = run_switch;
+    uint32_t cycles_per_tick = CHIPPERINO_DEFAULT_CYCLES_PER_TICK; // 0 when the host ticks the timers
+};
+
+extern "C" {
+
+chipperino_t *chipperino_create(void)
+{
+    return new (std::nothrow) chipperino();
+}
+
+void chipperino_destroy(chipperino_t *m)
+{
+    delete m;
+}
+
+void chipperino_set_engine(chipperino_t *m, chipperino_engine_t engine)
+{
+    switch (engine)
+    {
+    case CHIPPERINO_ENGINE_THREADED: m->engine = run_threaded; break;
+    case CHIPPERINO_ENGINE_JIT: m->engine = run_jit; break;
+    default: m->engine = run_switch; break;
+    }
+}
+
+int chipperino_load_rom(chipperino_t *m, const char *filename)
+{
+    int size = load_rom(&m->machine, filename);
+    // the ROM may replace code that already ran
+    if (size >= 0)
+        invalidate_decoded(&m->machine, program_offset, size);
+    return size;
+}
+
+int chipperino_load_rom_memory(chipperino_t *m, const uint8_t *rom, size_t size)
+{
+    if (!load_program(&m->machine, rom, size))
+        return -1;
+    invalidate_decoded(&m->machine, program_offset, size);
+    return (int)size;
+}
+
+uint64_t chipperino_step(chipperino_t *m, uint64_t n)
+{
+    uint64_t executed = 0;
+    while (executed < n)
+    {
+        uint32_t budget = n - executed > UINT32_MAX ? UINT32_MAX : (uint32_t)(n - executed);
+        // runs stop at every tick, so the timers change right where they do in the emulator
+        if (m->cycles_per_tick)
+            budget = std::min(budget, cycles_to_tick(&m->machine, m->cycles_per_tick));
+        uint32_t ran = m->engine(&m->machine, budget);
+        executed += ran;
+        if (m->cycles_per_tick)
+            advance_clock(&m->machine, ran, m->cycles_per_tick);
+        else
+            m->machine.cycles += ran;
+        if (ran < budget)
+            break; // the engine stopped early on its own
+    }
+    return executed;
+}
+
+void chipperino_set_cycles_per_tick(chipperino_t *m, uint32_t cycles)
+{
+    m->cycles_per_tick = cycles;
+}
+
+void chipperino_tick_timers(chipperino_t *m)
+{
+    tick_timers(&m->machine);
+}
+
+void chipperino_read_framebuffer(const chipperino_t *m, uint8_t *pixels)
+{
+    for (int y = 0; y < chip8_display_height; ++y)
+        for (int x = 0; x < chip8_display_width; ++x)
+            *pixels++ = display_pixel(&m->machine, x, y);
+}
+
+int chipperino_display_changed(chipperino_t *m)
+{
+    bool changed = m->machine.display_update;
+    m->machine.display_update = false;
+    return changed;
+}
+
+void chipperino_set_keys(chipperino_t *m, uint16_t keys)
+{
+    m->machine.input.keys = keys;
+}
+
+}
@@ -0,0 +1,62 @@
+#ifndef CHIPPERINO_H
+#define CHIPPERINO_H
+
+/* libchipperino: the CHIP8 core as a library. Every machine keeps all of its state to itself, so any number
+   of them can run in the same process, each on whichever thread drives it (one thread per machine at a time) */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIPPERINO_DISPLAY_WIDTH 64
+#define CHIPPERINO_DISPLAY_HEIGHT 32
+// Instructions per 1/60 s timer tick machines start with, the same ~500 KHz the emulator runs at
+#define CHIPPERINO_DEFAULT_CYCLES_PER_TICK 8333
+
+typedef struct chipperino chipperino_t;
+
+typedef enum {
+    CHIPPERINO_ENGINE_SWITCH = 0, // reference interpreter
+    CHIPPERINO_ENGINE_THREADED,   // threaded-code interpreter
+    CHIPPERINO_ENGINE_JIT,        // x86-64 recompiler, threaded interpreter elsewhere
+} chipperino_engine_t;
+
+// A fresh machine running the switch engine, NULL when out of memory
+chipperino_t *chipperino_create(void);
+void chipperino_destroy(chipperino_t *m);
+
+void chipperino_set_engine(chipperino_t *m, chipperino_engine_t engine);
+
+// Load a ROM at the program start. Both return the number of bytes loaded, or -1 on failure
+int chipperino_load_rom(chipperino_t *m, const char *filename);
+int chipperino_load_rom_memory(chipperino_t *m, const uint8_t *rom, size_t size);
+
+/* Execute up to n instructions and return how many ran. Returns early after a DRW, so the caller can
+   present the frame, and while the ROM waits for a key. The delay and sound timers tick as the instructions go
+   by, once every cycles per tick of them (see chipperino_set_cycles_per_tick()) */
+uint64_t chipperino_step(chipperino_t *m, uint64_t n);
+
+/* How many instructions make a 1/60 s timer tick, CHIPPERINO_DEFAULT_CYCLES_PER_TICK unless set. 0 stops
+   chipperino_step() from ticking the timers, for hosts that would rather do it with chipperino_tick_timers() */
+void chipperino_set_cycles_per_tick(chipperino_t *m, uint32_t cycles);
+
+// Advance the delay and sound timers by one 1/60 s tick, besides the ones chipperino_step() does
+void chipperino_tick_timers(chipperino_t *m);
+
+// 1 for every lit pixel and 0 otherwise, row by row, into CHIPPERINO_DISPLAY_WIDTH*CHIPPERINO_DISPLAY_HEIGHT bytes
+void chipperino_read_framebuffer(const chipperino_t *m, uint8_t *pixels);
+
+// Whether the display changed since the last call
+int chipperino_display_changed(chipperino_t *m);
+
+// Currently pressed keys as a bitfield, bit n for key n
+void chipperino_set_keys(chipperino_t *m, uint16_t keys);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,306 +3,486 @@
 
 #include <memory.h>
 #include "architecture.hpp"
+#include "opcodes.hpp"
 
-void dispatch(chip8_t *c = &chip8)
+// Turn a raw instruction into its handler id and operands, looking it up in the opcode table
+chip8_decoded_t decode(chip8_instruction_t i)
 {
-    chip8_instruction_t i = *(chip8_instruction_t *)&c->raw_memory[c->pc];
+    chip8_decoded_t d;
+    d.nnn = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
+    d.x = HALF_LOWER_BYTE(i.msb);
+    d.y = HALF_UPPER_BYTE(i.lsb);
+    d.kk = i.lsb;
+    d.op = find_opcode(instruction_word(i))->op;
+    return d;
+}
 
-    // first of all, increment the program counter
-    c->pc += 2;
-    
-    switch (HALF_UPPER_BYTE(i.msb))
+// Get the decoded form of the instruction at addr, decoding it on first use
+chip8_decoded_t *fetch_decoded(chip8_t *c, uint16_t addr)
+{
+    if (addr >= memory_size - 1)
     {
-    case 0x0: // i: 0x0---
-        if (HALF_LOWER_BYTE(i.msb) == 0x0) // i: 0x00--
-        {
-            if (HALF_LOWER_BYTE(i.lsb) == 0x0) // i: 0x00E0: CLS (clear screen)
-            {
-                memset(c->display, 0, sizeof(c->display));
-            }
-            else if (HALF_LOWER_BYTE(i.lsb) == 0xE) // i: 0x00EE: RET
-            {
-                // TODO: stack pointer underflow detection?
-                c->pc = c->stack[--c->sp];
-            }
-            else
-            {
-                // unexpected combination
-                // TODO: error handling
-            }
-        }
-        else // i: 0x0nnn: SYS addr
-        {
-            c->pc = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
-        }
-        break;
+        // an instruction here would straddle the end of memory, there is nothing sensible to decode
+        static chip8_decoded_t out_of_bounds = { 0, OP_ERROR, 0, 0, 0 };
+        return &out_of_bounds;
+    }
 
-    case 0x1: // i: 0x1nnn: JMP addr
-        c->pc = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
-        break;
+    chip8_decoded_t *d = &c->decoded[addr];
+    if (d->op == OP_UNDECODED)
+        *d = decode(*(chip8_instruction_t *)&c->raw_memory[addr]);
+    return d;
+}
 
-    case 0x2: // i: 0x2nnn: CALL addr
-        // TODO: stack pointer overflow detection
-        c->stack[c->sp++] = c->pc;
-        c->pc = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
-        break;
+/* Drop the decoded instructions overlapping the len bytes written at addr.
+   An instruction starting one byte before addr also reads the first written byte */
+void invalidate_decoded(chip8_t *c, uint16_t addr, uint16_t len)
+{
+    uint32_t first = addr ? addr - 1 : 0;
+    uint32_t last = (uint32_t)addr + len;
+    if (last > memory_size)
+        last = memory_size;
 
-    case 0x3: // i: 0x3xkk: SE Vx, byte
+    bool hit = false;
+    for (uint32_t j = first; j < last; ++j)
     {
-        uint8_t reg_contents = c->regs[HALF_LOWER_BYTE(i.msb)];
-        if (reg_contents == i.lsb)
-            c->pc += sizeof(chip8_instruction_t);
-    } break;
+        hit |= c->decoded[j].op != OP_UNDECODED;
+        c->decoded[j].op = OP_UNDECODED;
+    }
 
-    case 0x4: // i: 0x4xkk: SNE Vx, byte
-    {
-        uint8_t reg_contents = c->regs[HALF_LOWER_BYTE(i.msb)];
-        if (reg_contents != i.lsb)
-            c->pc += sizeof(chip8_instruction_t);
-    } break;
-        
-    case 0x5: // i: 0x5xy0: SE Vx, Vy
-    {
-        uint8_t reg1 = c->regs[HALF_LOWER_BYTE(i.msb)];
-        uint8_t reg2 = c->regs[HALF_UPPER_BYTE(i.lsb)];
-        if (reg1 == reg2)
-            c->pc += sizeof(chip8_instruction_t);
-    } break;
-        
-    case 0x6: // i: 0x6xkk: LD Vx, byte        
-        c->regs[HALF_LOWER_BYTE(i.msb)] = i.lsb;
-        break;
+    // only writes over code move the epoch, data writes are the common case
+    if (hit)
+        c->code_epoch = next_code_epoch();
+}
 
-    case 0x7: // i: 0x7xkk: ADD Vx, byte
-        c->regs[HALF_LOWER_BYTE(i.msb)] += i.lsb;
-        break;
+/** Instruction handlers, shared by every engine **/
 
-    case 0x8: // i: 0x8---
-        switch (HALF_LOWER_BYTE(i.lsb))
-        {
-        case 0x0: // i: 0x8xy0: LD Vx, Vy
-            c->regs[HALF_LOWER_BYTE(i.msb)] = c->regs[HALF_UPPER_BYTE(i.lsb)];
-            break;
+// i: 0x00E0: CLS (clear screen)
+void op_cls(chip8_t *c, chip8_decoded_t /*d*/)
+{
+    memset(c->display, 0, sizeof(c->display));
+}
 
-        case 0x1: // i: 0x8xy1: OR Vx, Vy
-            c->regs[HALF_LOWER_BYTE(i.msb)] |= c->regs[HALF_UPPER_BYTE(i.lsb)];
-            break;
+// i: 0x00EE: RET
+void op_ret(chip8_t *c, chip8_decoded_t /*d*/)
+{
+    // TODO: stack pointer underflow detection?
+    c->pc = c->stack[--c->sp];
+}
 
-        case 0x2: // i: 0x8xy2: AND Vx, Vy
-            c->regs[HALF_LOWER_BYTE(i.msb)] &= c->regs[HALF_UPPER_BYTE(i.lsb)];
-            break;
+// i: 0x0nnn: SYS addr
+void op_sys(chip8_t *c, chip8_decoded_t d)
+{
+    c->pc = d.nnn;
+}
 
-        case 0x3: // i: 0x8xy3: XOR Vx, Vy
-            c->regs[HALF_LOWER_BYTE(i.msb)] ^= c->regs[HALF_UPPER_BYTE(i.lsb)];
-            break;
+// i: 0x1nnn: JMP addr
+void op_jp(chip8_t *c, chip8_decoded_t d)
+{
+    c->pc = d.nnn;
+}
 
-        case 0x4: // i: 0x8xy4: ADD Vx, Vy
-        {
-            uint16_t res = c->regs[HALF_LOWER_BYTE(i.msb)] + c->regs[HALF_UPPER_BYTE(i.lsb)];
-            // Update carry flag
-            c->VF = res > 0xFF ? 1 : 0;
-            // Only store lower 8b
-            c->regs[HALF_LOWER_BYTE(i.msb)] = res & 0xFF;
-        } break;
-
-        case 0x5: // i: 0x8xy5: SUB Vx, Vy
-        {
-            int16_t diff = (int16_t)c->regs[HALF_LOWER_BYTE(i.msb)] - (int16_t)c->regs[HALF_UPPER_BYTE(i.lsb)];
-            c->VF = diff > 0 ? 0 : 1;
-            c->regs[HALF_LOWER_BYTE(i.msb)] = diff & 0xFF;
-        } break;
-            
-
-        case 0x6: // i: 0x8xy6: SHR Vx, {,Vy}
-            c->VF = c->regs[HALF_LOWER_BYTE(i.msb)] & 1;
-            c->regs[HALF_LOWER_BYTE(i.msb)] >>= 1;
-            break;
+// i: 0x2nnn: CALL addr
+void op_call(chip8_t *c, chip8_decoded_t d)
+{
+    // TODO: stack pointer overflow detection
+    c->stack[c->sp++] = c->pc;
+    c->pc = d.nnn;
+}
 
-        case 0x7: // i: 0x8xy7: SUBN Vx, Vy
-        {
-            int16_t diff = (int16_t)c->regs[HALF_LOWER_BYTE(i.lsb)] - (int16_t)c->regs[HALF_UPPER_BYTE(i.msb)];
-            c->VF = diff > 0 ? 1 : 0;
-            c->regs[HALF_LOWER_BYTE(i.msb)] = diff & 0xFF;
-        } break;
-
-        case 0xE: // i: 0x8xyE: SHL Vx, {,Vy}
-            c->VF = (c->regs[HALF_LOWER_BYTE(i.msb)] & 0xA000) >> 7;
-            c->regs[HALF_LOWER_BYTE(i.msb)] <<= 1;
-            break;
-        default:
-            // TODO: Error handling?
-            break;
-        }
-        break;
+// i: 0x3xkk: SE Vx, byte
+void op_se_byte(chip8_t *c, chip8_decoded_t d)
+{
+    if ((uint8_t)c->regs[d.x] == d.kk)
+        c->pc += sizeof(chip8_instruction_t);
+}
 
-    case 0x9: // i: 0x9xy0: SNE Vx, Vy
-        if (c->regs[HALF_LOWER_BYTE(i.msb)] != c->regs[HALF_UPPER_BYTE(i.lsb)])
-            c->pc += sizeof(chip8_instruction_t);
-        break;
+// i: 0x4xkk: SNE Vx, byte
+void op_sne_byte(chip8_t *c, chip8_decoded_t d)
+{
+    if ((uint8_t)c->regs[d.x] != d.kk)
+        c->pc += sizeof(chip8_instruction_t);
+}
 
-    case 0xA: // i: 0xAnnn: LD I, addr
-        c->I = (HALF_LOWER_BYTE(i.msb) << 8) | i.lsb;
-        break;
+// i: 0x5xy0: SE Vx, Vy
+void op_se_reg(chip8_t *c, chip8_decoded_t d)
+{
+    if ((uint8_t)c->regs[d.x] == (uint8_t)c->regs[d.y])
+        c->pc += sizeof(chip8_instruction_t);
+}
 
-    case 0xB: // i: 0xBnnn: JP V0, addr
-        c->pc = ((HALF_LOWER_BYTE(i.msb) << 8) | i.lsb) + c->V0;
-        break;
+// i: 0x6xkk: LD Vx, byte
+void op_ld_byte(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] = d.kk;
+}
+
+// i: 0x7xkk: ADD Vx, byte
+void op_add_byte(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] += d.kk;
+}
+
+// i: 0x8xy0: LD Vx, Vy
+void op_ld_reg(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] = c->regs[d.y];
+}
+
+// i: 0x8xy1: OR Vx, Vy
+void op_or(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] |= c->regs[d.y];
+}
+
+// i: 0x8xy2: AND Vx, Vy
+void op_and(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] &= c->regs[d.y];
+}
+
+// i: 0x8xy3: XOR Vx, Vy
+void op_xor(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] ^= c->regs[d.y];
+}
+
+// i: 0x8xy4: ADD Vx, Vy
+void op_add_reg(chip8_t *c, chip8_decoded_t d)
+{
+    uint16_t res = c->regs[d.x] + c->regs[d.y];
+    // Update carry flag
+    c->VF = res > 0xFF ? 1 : 0;
+    // Only store lower 8b
+    c->regs[d.x] = res & 0xFF;
+}
+
+// i: 0x8xy5: SUB Vx, Vy
+void op_sub(chip8_t *c, chip8_decoded_t d)
+{
+    int16_t diff = (int16_t)c->regs[d.x] - (int16_t)c->regs[d.y];
+    c->VF = diff > 0 ? 0 : 1;
+    c->regs[d.x] = diff & 0xFF;
+}
+
+// i: 0x8xy6: SHR Vx, {,Vy}
+void op_shr(chip8_t *c, chip8_decoded_t d)
+{
+    c->VF = c->regs[d.x] & 1;
+    c->regs[d.x] >>= 1;
+}
+
+// i: 0x8xy7: SUBN Vx, Vy
+void op_subn(chip8_t *c, chip8_decoded_t d)
+{
+    int16_t diff = (int16_t)c->regs[d.y] - (int16_t)c->regs[d.x];
+    c->VF = diff > 0 ? 1 : 0;
+    c->regs[d.x] = diff & 0xFF;
+}
+
+// i: 0x8xyE: SHL Vx, {,Vy}
+void op_shl(chip8_t *c, chip8_decoded_t d)
+{
+    c->VF = (c->regs[d.x] & 0xA000) >> 7;
+    c->regs[d.x] <<= 1;
+}
+
+// i: 0x9xy0: SNE Vx, Vy
+void op_sne_reg(chip8_t *c, chip8_decoded_t d)
+{
+    if (c->regs[d.x] != c->regs[d.y])
+        c->pc += sizeof(chip8_instruction_t);
+}
+
+// i: 0xAnnn: LD I, addr
+void op_ld_i(chip8_t *c, chip8_decoded_t d)
+{
+    c->I = d.nnn;
+}
+
+// i: 0xBnnn: JP V0, addr
+void op_jp_v0(chip8_t *c, chip8_decoded_t d)
+{
+    c->pc = d.nnn + c->V0;
+}
+
+// i: 0xCxkk: RND Vx, byte
+void op_rnd(chip8_t *c, chip8_decoded_t d)
+{
+    uint32_t r = pcg32_random_r(&c->rng);
+    c->regs[d.x] = r & d.kk;
+}
+
+// i: 0xDxyn: DRW Vx, Vy, nibble
+void op_drw(chip8_t *c, chip8_decoded_t d)
+{
+    // executing an instruction that changes the display
+    c->display_update = true;
 
-    case 0xC: // i: 0xCxkk: RND Vx, byte
+    uint64_t collision = 0;
+    unsigned x = (uint8_t)c->regs[d.x] % chip8_display_width;
+    unsigned y = (uint8_t)c->regs[d.y];
+    uint8_t nibble = HALF_LOWER_BYTE(d.kk);
+
+    for (int j = 0; j < nibble; ++j)
     {
-        uint32_t r = pcg32_random_r(&c->rng);
-        c->regs[HALF_LOWER_BYTE(i.msb)] = r & i.lsb;
-    } break;
+        // put the sprite row on the left edge, then rotate it into place so it wraps horizontally
+        uint64_t sprite = (uint64_t)c->raw_memory[c->I+j] << (chip8_display_width - 8);
+        sprite = (sprite >> x) | (sprite << ((chip8_display_width - x) % chip8_display_width));
+        // wrap vertically if need be
+        uint64_t *row = &c->display[(y + j) & (chip8_display_height - 1)];
+        // any pixel we flip from 1 to 0 is a collision
+        collision |= *row & sprite;
+        *row ^= sprite;
+    }
+    c->VF = collision != 0;
+}
 
-    case 0xD: // i: 0xDxyn: DRW Vx, Vy, nibble
+// i: 0xEx9E: SKP Vx
+void op_skp(chip8_t *c, chip8_decoded_t d)
+{
+    int8_t keycode = c->regs[d.x];
+    if ((c->input.keys >> keycode) & 1)
+        c->pc += 2;
+}
 
+// i: 0xExA1: SKNP Vx
+void op_sknp(chip8_t *c, chip8_decoded_t d)
+{
+    int8_t keycode = c->regs[d.x];
+    if (!((c->input.keys >> keycode) & 1))
+        c->pc += 2;
+}
+
+// i: 0xFx07: LD Vx, DT
+void op_ld_vx_dt(chip8_t *c, chip8_decoded_t d)
+{
+    c->regs[d.x] = c->dt;
+}
+
+// i: 0xFx0A: LD Vx, K
+void op_ld_vx_k(chip8_t *c, chip8_decoded_t d)
+{
+    if (c->input.keys)
     {
-        // executing an instruction that changes the display
-        display_update = true;
-        
-        uint8_t collision_flag = 0;
-        uint8_t target_x = c->regs[HALF_LOWER_BYTE(i.msb)];
-        uint8_t x = target_x;
-        uint8_t y = c->regs[HALF_UPPER_BYTE(i.lsb)];
-        uint8_t nibble = HALF_LOWER_BYTE(i.lsb);
-        
-
-        for (int j = 0; j < nibble; ++j, ++y)
+        for (uint8_t j = 0; j < 16; ++j)
         {
-            x = target_x;
-            // wrap vertically if need be
-            y %= chip8_display_height;
-            uint8_t sprite = c->raw_memory[c->I+j];
-            for (int k = 0; k < 8; ++k, ++x)
-            {
-                // Wrap horizontally if need be
-                x %= chip8_display_width;
-                uint8_t prev = c->display[y][x];
-                uint8_t next = prev ^ (sprite >> (7-k) & 1);
-                c->display[y][x] = next;
-                if (prev && !next) // we flipped from 1 to 0
-                    collision_flag = 1;
-            }
+            uint16_t key = c->input.keys & (1 << j);
+            if (key)
+                c->regs[d.x] = j;
         }
-        c->VF = collision_flag;
-    } break;
-        
-    case 0xE: // i: 0xE---
-        if (i.lsb == 0x9E) // i: 0xEx9E: SKP Vx
-        {
-            int8_t keycode = c->regs[HALF_LOWER_BYTE(i.msb)];
-            if ((c->input.keys >> keycode) & 1)
-            {
-                c->pc += 2;
-                /* NOTE: Clearing input key to make sure the ROM does not read the same key again and again
-                   since we poll it much slower than the CPU clockrate */
-                c->input.keys &= ~(1 << keycode);
-            }
-            break;
-        }
-        else if (i.lsb == 0xA1) // i: 0xExA1: SKNP Vx
-        {
-            int8_t keycode = c->regs[HALF_LOWER_BYTE(i.msb)];
-            if (!((c->input.keys >> keycode) & 1))
-            {
-                c->pc += 2;
-                /* NOTE: Clearing input key to make sure the ROM does not read the same key again and again
-                   since we poll it much slower than the CPU clockrate */
-                c->input.keys &= ~(1 << keycode);
-            }
-            break;
-        }
-        else
-        {
-            // TODO: error handling?
-            break;
-        }
-        break;
+    }
+    else
+    {
+        c->pc -= 2; // return to same instruction as a form of waiting
+        return;
+    }
+}
 
-    case 0xF: // i: 0xF---
-        switch (i.lsb)
-        {
-        case 0x07: // i: 0xFx07: LD Vx, DT
-            c->regs[HALF_LOWER_BYTE(i.msb)] = c->dt;
-            break;
+// i: 0xFx15: LD DT, Vx
+void op_ld_dt_vx(chip8_t *c, chip8_decoded_t d)
+{
+    c->dt = c->regs[d.x];
+}
 
-        case 0x0A: // i: 0xFx0A: LD Vx, K
-        {
-            if (c->input.keys)
-            {
-                for (uint8_t j = 0; j < 16; ++j)
-                {
-                    uint16_t key = c->input.keys & (1 << j);
-                    if (key)
-                    {
-                        c->regs[HALF_LOWER_BYTE(i.msb)] = j;
-                        /* NOTE: Clearing input key to make sure the ROM does not read the same key again and again
-                           since we poll it much slower than the CPU clockrate */
-                        c->input.keys &= ~(1 << j);
-                    }
-                }
-            }
-            else
-            {
-                c->pc -= 2; // return to same instruction as a form of waiting
-                return;
-            }
-            
-        } break;
-
-        case 0x15: // i: 0xFx15: LD DT, Vx
-            c->dt = c->regs[HALF_LOWER_BYTE(i.msb)];
-            break;
-            
-        case 0x18: // i: 0xFx18: LD ST, Vx
-            c->st = c->regs[HALF_LOWER_BYTE(i.msb)];
-            break;
+// i: 0xFx18: LD ST, Vx
+void op_ld_st_vx(chip8_t *c, chip8_decoded_t d)
+{
+    c->st = c->regs[d.x];
+}
 
-        case 0x1E: // i: 0xFx1E: ADD I, 
-            c->I += c->regs[HALF_LOWER_BYTE(i.msb)];
-            break;
+// i: 0xFx1E: ADD I,
+void op_add_i_vx(chip8_t *c, chip8_decoded_t d)
+{
+    c->I += c->regs[d.x];
+}
 
-        case 0x29: // i: 0xFx29: LD F, Vx
-            c->I = default_font_offset + c->regs[HALF_LOWER_BYTE(i.msb)] * default_letter_size;
-            break;
+// i: 0xFx29: LD F, Vx
+void op_ld_f_vx(chip8_t *c, chip8_decoded_t d)
+{
+    c->I = default_font_offset + c->regs[d.x] * default_letter_size;
+}
 
-        case 0x33: // i: 0xFx33: LD B, Vx
-        {
-            uint8_t reg_value = c->regs[HALF_LOWER_BYTE(i.msb)];
-            c->raw_memory[c->I] = (reg_value/100) % 10;
-            c->raw_memory[c->I+1] = (reg_value/10) % 10;
-            c->raw_memory[c->I+2] = reg_value % 10;
-        } break;
+// i: 0xFx33: LD B, Vx
+void op_ld_b_vx(chip8_t *c, chip8_decoded_t d)
+{
+    uint8_t reg_value = c->regs[d.x];
+    c->raw_memory[c->I] = (reg_value/100) % 10;
+    c->raw_memory[c->I+1] = (reg_value/10) % 10;
+    c->raw_memory[c->I+2] = reg_value % 10;
+    // the ROM may have just overwritten its own code
+    invalidate_decoded(c, c->I, 3);
+}
 
-        case 0x55: // i: 0xFx55
-        {
-            uint8_t last_idx = HALF_LOWER_BYTE(i.msb);
-            for (uint8_t i = 0; i <= last_idx && i < 16; ++i)
-            {
-                uint8_t value = c->regs[i];
-                c->raw_memory[c->I + i] = value;
-            }
-        } break;
-
-        case 0x65: // i: 0xFx65
-        {
-            uint8_t last_idx = HALF_LOWER_BYTE(i.msb);
-            for (uint8_t i = 0; i <= last_idx && i < 16; ++i)
-            {
-                uint8_t value = c->raw_memory[c->I + i];
-                c->regs[i] = value;
-            }
-        } break;
-
-        default:
-            // TODO: error handling?
-            break;        
-        }
-        break;
+// i: 0xFx55
+void op_ld_mem_vx(chip8_t *c, chip8_decoded_t d)
+{
+    uint8_t last_idx = d.x;
+    for (uint8_t i = 0; i <= last_idx && i < 16; ++i)
+    {
+        uint8_t value = c->regs[i];
+        c->raw_memory[c->I + i] = value;
+    }
+    // the ROM may have just overwritten its own code
+    invalidate_decoded(c, c->I, last_idx + 1);
+}
+
+// i: 0xFx65
+void op_ld_vx_mem(chip8_t *c, chip8_decoded_t d)
+{
+    uint8_t last_idx = d.x;
+    for (uint8_t i = 0; i <= last_idx && i < 16; ++i)
+    {
+        uint8_t value = c->raw_memory[c->I + i];
+        c->regs[i] = value;
+    }
+}
+
+void dispatch(chip8_t *c)
+{
+    const chip8_decoded_t d = *fetch_decoded(c, c->pc);
+
+    // first of all, increment the program counter
+    c->pc += 2;
+
+    switch (d.op)
+    {
+    case OP_CLS: op_cls(c, d); break;
+    case OP_RET: op_ret(c, d); break;
+    case OP_SYS: op_sys(c, d); break;
+    case OP_JP: op_jp(c, d); break;
+    case OP_CALL: op_call(c, d); break;
+    case OP_SE_BYTE: op_se_byte(c, d); break;
+    case OP_SNE_BYTE: op_sne_byte(c, d); break;
+    case OP_SE_REG: op_se_reg(c, d); break;
+    case OP_LD_BYTE: op_ld_byte(c, d); break;
+    case OP_ADD_BYTE: op_add_byte(c, d); break;
+    case OP_LD_REG: op_ld_reg(c, d); break;
+    case OP_OR: op_or(c, d); break;
+    case OP_AND: op_and(c, d); break;
+    case OP_XOR: op_xor(c, d); break;
+    case OP_ADD_REG: op_add_reg(c, d); break;
+    case OP_SUB: op_sub(c, d); break;
+    case OP_SHR: op_shr(c, d); break;
+    case OP_SUBN: op_subn(c, d); break;
+    case OP_SHL: op_shl(c, d); break;
+    case OP_SNE_REG: op_sne_reg(c, d); break;
+    case OP_LD_I: op_ld_i(c, d); break;
+    case OP_JP_V0: op_jp_v0(c, d); break;
+    case OP_RND: op_rnd(c, d); break;
+    case OP_DRW: op_drw(c, d); break;
+    case OP_SKP: op_skp(c, d); break;
+    case OP_SKNP: op_sknp(c, d); break;
+    case OP_LD_VX_DT: op_ld_vx_dt(c, d); break;
+    case OP_LD_VX_K: op_ld_vx_k(c, d); break;
+    case OP_LD_DT_VX: op_ld_dt_vx(c, d); break;
+    case OP_LD_ST_VX: op_ld_st_vx(c, d); break;
+    case OP_ADD_I_VX: op_add_i_vx(c, d); break;
+    case OP_LD_F_VX: op_ld_f_vx(c, d); break;
+    case OP_LD_B_VX: op_ld_b_vx(c, d); break;
+    case OP_LD_MEM_VX: op_ld_mem_vx(c, d); break;
+    case OP_LD_VX_MEM: op_ld_vx_mem(c, d); break;
     default:
         // TODO: error handling?
-        break;        
+        break;
+    }
+}
+
+/** Idle loops **/
+
+/* Whether the instruction at addr starts the usual way of waiting for DT to run out:
+       addr:     LD Vx, DT
+       addr + 2: SE Vx, 0
+       addr + 4: JP addr */
+bool is_dt_wait_loop(chip8_t *c, uint16_t addr)
+{
+    const chip8_decoded_t *ld = fetch_decoded(c, addr);
+    const chip8_decoded_t *se = fetch_decoded(c, addr + 2);
+    const chip8_decoded_t *jp = fetch_decoded(c, addr + 4);
+    return ld->op == OP_LD_VX_DT && se->op == OP_SE_BYTE && se->x == ld->x && se->kk == 0 && jp->op == OP_JP &&
+           jp->nnn == addr;
+}
+
+enum chip8_idle_t : uint8_t {
+    IDLE_NONE,
+    IDLE_DT_WAIT,  // nothing will change until the next timer tick
+    IDLE_KEY_WAIT, // nothing will change until a key is pressed, Fx0A is waiting for one
+    IDLE_HALTED,   // nothing will ever change, pc is at a jump to itself
+};
+
+/* Whether c is only waiting, in a loop or in Fx0A. Spinning through one takes a whole core and gets the ROM
+   nowhere, so engines stop when they get to one and whoever runs them skips ahead instead */
+chip8_idle_t idle_state(chip8_t *c)
+{
+    const chip8_decoded_t *d = fetch_decoded(c, c->pc);
+    if (d->op == OP_JP && d->nnn == c->pc)
+        return IDLE_HALTED;
+    if (d->op == OP_LD_VX_K && !c->input.keys)
+        return IDLE_KEY_WAIT;
+    if (c->dt && d->op == OP_LD_VX_DT && is_dt_wait_loop(c, c->pc))
+        return IDLE_DT_WAIT;
+    return IDLE_NONE;
+}
+
+/** Virtual clock **/
+
+/* DT and ST count down at 60 Hz of the machine's own time, chip8_t::cycles, every cycles_per_tick of it. No
+   host clock is involved: whoever runs the machine moves its clock forward by what it ran, and pacing that to
+   real time, if at all, is up to the frame scheduler. So the same cycles give the same ticks at any speed */
+
+void tick_timers(chip8_t *c)
+{
+    if (c->dt > 0)
+        --c->dt;
+    if (c->st > 0)
+        --c->st;
+}
+
+// Cycles left until the next tick
+uint32_t cycles_to_tick(const chip8_t *c, uint32_t cycles_per_tick)
+{
+    return cycles_per_tick - c->cycles % cycles_per_tick;
+}
+
+// Move the clock of c forward by n cycles, ticking the timers once for every tick in them. Returns the ticks
+uint64_t advance_clock(chip8_t *c, uint64_t n, uint32_t cycles_per_tick)
+{
+    uint64_t ticks = (c->cycles + n) / cycles_per_tick - c->cycles / cycles_per_tick;
+    c->cycles += n;
+    // past 255 ticks both timers are at 0 whatever they started at
+    for (uint64_t i = 0; i < ticks && i < 0xFF; ++i)
+        tick_timers(c);
+    return ticks;
+}
+
+/** Engines **/
+
+/* An engine runs up to budget instructions and returns how many it executed.
+   Engines stop early after a DRW, so the caller can present the frame, while Fx0A waits for a key and after a
+   JP into an idle loop (see idle_state()) */
+typedef uint32_t engine_f(chip8_t *c, uint32_t budget);
+
+// Whether an engine stops after running the instruction at pc, whose handler id was op
+bool engine_stops_after(chip8_t *c, uint8_t op, uint16_t pc)
+{
+    return op == OP_DRW || (op == OP_LD_VX_K && c->pc == pc) || (op == OP_JP && idle_state(c));
+}
+
+// The reference engine: one dispatch() per instruction
+uint32_t run_switch(chip8_t *c, uint32_t budget)
+{
+    uint32_t executed = 0;
+    while (executed < budget)
+    {
+        uint16_t pc = c->pc;
+        uint8_t op = fetch_decoded(c, pc)->op;
+
+        dispatch(c);
+        ++executed;
+
+        if (engine_stops_after(c, op, pc))
+            break;
     }
+    return executed;
 }
 
 #endif
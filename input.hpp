@@ -0,0 +1,149 @@
+#ifndef CHIPPERINO_INPUT_H
+#define CHIPPERINO_INPUT_H
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "utils.hpp"
+#include "scheduler.hpp"
+
+/* Terminal input, read on its own thread. The reader sleeps in poll() until there are bytes on stdin and hands
+   each of them to the CPU thread through a single producer, single consumer queue, so the CPU thread never makes
+   a syscall to look for keys. The CPU thread sleeps on the queue until the end of every frame, so a key wakes it
+   up right away: it catches up with the wall clock and the key goes down at that point of the frame.
+
+   Terminals send presses, and repeats while a key is held, but never releases: a key counts as released at the
+   end of the frame it was pressed in */
+
+struct key_event_t {
+    char key; // as read, not mapped to a CHIP-8 key yet
+};
+
+// Events the queue holds, a power of two. Far more than anyone types in a frame
+const uint32_t input_queue_size = 256;
+// How long the reader waits in poll() before checking whether it has been stopped
+const int64_t input_poll_period_ns = 50000000;
+
+struct input_queue_t {
+    key_event_t events[input_queue_size];
+    std::atomic<uint32_t> head{0}; // events pushed, only written by the reader
+    std::atomic<uint32_t> tail{0}; // events popped, only written by the CPU thread
+};
+
+struct input_reader_t {
+    input_queue_t queue;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    // only there for the CPU thread to sleep on while it waits for keys, events never go through them
+    std::mutex lock;
+    std::condition_variable pushed;
+};
+
+// Returns false, leaving q as it was, if it is full
+bool push_key_event(input_queue_t *q, key_event_t e)
+{
+    uint32_t head = q->head.load(std::memory_order_relaxed);
+    // acquire so the consumer is done with the slot we are about to write
+    if (head - q->tail.load(std::memory_order_acquire) == input_queue_size)
+        return false;
+    q->events[head & (input_queue_size - 1)] = e;
+    // release so the event is there before the consumer sees it
+    q->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Returns false if q is empty
+bool pop_key_event(input_queue_t *q, key_event_t *e)
+{
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    if (tail == q->head.load(std::memory_order_acquire))
+        return false;
+    *e = q->events[tail & (input_queue_size - 1)];
+    q->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void input_read_loop(input_reader_t *r)
+{
+    while (r->running.load(std::memory_order_relaxed))
+    {
+        if (!wait_for_input(input_poll_period_ns))
+            continue;
+
+        char key;
+        bool read = false;
+        while (read_raw_input(&key, 1))
+        {
+            // a full queue means the CPU thread is held up, better late than lost
+            while (!push_key_event(&r->queue, { key }) && r->running.load(std::memory_order_relaxed))
+                std::this_thread::yield();
+            read = true;
+        }
+        if (read)
+        {
+            // taking the lock makes sure a CPU thread about to sleep in wait_for_key_event() gets woken up
+            std::lock_guard<std::mutex> lock(r->lock);
+            r->pushed.notify_one();
+        }
+    }
+}
+
+// The terminal has to be in raw mode already, see set_console_raw_mode()
+void start_input_reader(input_reader_t *r)
+{
+    r->running = true;
+    r->thread = std::thread(input_read_loop, r);
+}
+
+// Takes up to input_poll_period_ns, for the reader to come out of poll()
+void stop_input_reader(input_reader_t *r)
+{
+    r->running = false;
+    if (r->thread.joinable())
+        r->thread.join();
+}
+
+bool key_events_pending(input_reader_t *r)
+{
+    return r->queue.head.load(std::memory_order_acquire) != r->queue.tail.load(std::memory_order_relaxed);
+}
+
+/* Block until there are events to pop or timeout_ns go by, forever if timeout_ns is negative. Returns whether
+   there are events */
+bool wait_for_key_event(input_reader_t *r, int64_t timeout_ns = -1)
+{
+    auto ready = [r] { return key_events_pending(r); };
+    std::unique_lock<std::mutex> lock(r->lock);
+    if (timeout_ns < 0)
+    {
+        r->pushed.wait(lock, ready);
+        return true;
+    }
+    return r->pushed.wait_for(lock, std::chrono::nanoseconds(timeout_ns), ready);
+}
+
+/* Sleep until the absolute deadline of the current frame, or until there are events to pop if that comes first,
+   so the frame can catch up with the wall clock and the keys go down where it has got to. The last spin_ns are
+   spent spinning, still looking out for keys, to cover for the kernel waking us up late. Returns whether there
+   are events */
+bool wait_for_deadline_or_key(scheduler_t *s, input_reader_t *r)
+{
+    auto ready = [r] { return key_events_pending(r); };
+    auto wake = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::nanoseconds(s->deadline_ns - s->spin_ns)));
+    {
+        std::unique_lock<std::mutex> lock(r->lock);
+        if (r->pushed.wait_until(lock, wake, ready))
+            return true;
+    }
+    while (monotonic_ns() < s->deadline_ns)
+        if (key_events_pending(r))
+            return true;
+    return key_events_pending(r);
+}
+
+#endif
@@ -0,0 +1,542 @@
+#ifndef CHIPPERINO_JIT_H
+#define CHIPPERINO_JIT_H
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "threaded.hpp"
+
+/* Dynamic recompiler. Guest basic blocks are translated into x86-64 functions and cached by guest address.
+   Inside a block the guest registers it touches live in host registers; simple ALU, timer and I operations are
+   emitted natively and everything else calls dispatch() on the in-memory state, so both engines share one
+   definition of the hairy instructions.
+
+   A compiled block is a function uint32_t block(chip8_t *c, uint32_t budget) that returns the budget left.
+   The budget is counted down after every instruction, so the JIT stops on exactly the same instruction as the
+   other engines and can be single-stepped */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+
+// Size of the executable buffer every thread translates into, flushed as a whole when it fills up
+const uint32_t jit_code_size = 1 << 20;
+// Longest block we translate, in instructions
+const uint16_t jit_max_block_length = 64;
+// Bytes it takes to load or store a guest register held in a host register, see emit_mem8()
+const uint32_t jit_register_bytes = 7;
+/* Worst case of bytes emitted per instruction, besides the registers jit_emit_fallback() stores and reloads: the
+   instruction itself (at most the call in jit_emit_fallback()), counting the budget down, the jz to its exit
+   stub and the stub */
+const uint32_t jit_max_bytes_per_instruction = 32 + 4 + 6 + 14;
+// Prologue, epilogue and the pc stored after a block that runs off its end, besides their register moves
+const uint32_t jit_max_bytes_per_block = 64;
+
+typedef uint32_t jit_code_f(chip8_t *c, uint32_t budget);
+
+struct jit_block_t {
+    jit_code_f *code;   // NULL when not translated yet
+    uint16_t length;    // in instructions
+    uint16_t last_addr; // address of the last instruction in the block
+    uint8_t last_op;    // handler id of the last instruction in the block
+};
+
+struct chip8_jit_t {
+    uint8_t *code;          // executable buffer, mapped on first use
+    uint32_t code_used;
+    uint32_t code_epoch;    // chip8_t::code_epoch the blocks below were translated from
+    bool unavailable;       // we could not map executable memory, everything goes through dispatch()
+    jit_block_t blocks[memory_size];
+
+    ~chip8_jit_t()
+    {
+        if (code)
+            munmap(code, jit_code_size);
+    }
+};
+
+// Every thread gets its own translations, they are redone when the thread moves on to another machine
+thread_local chip8_jit_t jit_context = {};
+
+/** x86-64 encoding **/
+
+// Host registers, in encoding order
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Host registers guest registers may be allocated to. RBX holds the chip8_t pointer and R15 the budget,
+   RAX and RCX are scratch */
+const uint8_t jit_allocatable[] = { RBP, R12, R13, R14, RSI, RDI, R8, R9, R10, R11 };
+const int jit_no_register = -1;
+
+struct jit_emitter_t {
+    uint8_t *p;
+    int8_t host[16]; // host register holding each guest register, or jit_no_register
+};
+
+void emit8(jit_emitter_t *e, uint8_t b) { *e->p++ = b; }
+void emit16(jit_emitter_t *e, uint16_t w) { memcpy(e->p, &w, 2); e->p += 2; }
+void emit32(jit_emitter_t *e, uint32_t w) { memcpy(e->p, &w, 4); e->p += 4; }
+void emit64(jit_emitter_t *e, uint64_t w) { memcpy(e->p, &w, 8); e->p += 8; }
+
+/* REX prefix for byte operations. Always emitted, otherwise encodings 4-7 would mean AH-BH rather than
+   SPL-DIL */
+void emit_rex(jit_emitter_t *e, int reg, int rm)
+{
+    emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// <opcode> r/m8, r8 with both operands in registers (MOV 0x88, OR 0x08, AND 0x20, XOR 0x30, CMP 0x38)
+void emit_rr8(jit_emitter_t *e, uint8_t opcode, int rm, int reg)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Group 1 operation on r8 with an imm8 (ADD /0, OR /1, AND /4, SUB /5, CMP /7)
+void emit_ri8(jit_emitter_t *e, int ext, int rm, uint8_t imm)
+{
+    emit_rex(e, 0, rm);
+    emit8(e, 0x80);
+    emit8(e, 0xC0 | (ext << 3) | (rm & 7));
+    emit8(e, imm);
+}
+
+// MOV r8, imm8
+void emit_mov_ri8(jit_emitter_t *e, int reg, uint8_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB0 + (reg & 7));
+    emit8(e, imm);
+}
+
+// Shift r8 by one (SHL /4, SAR /7)
+void emit_shift1(jit_emitter_t *e, int ext, int rm)
+{
+    emit_rex(e, 0, rm);
+    emit8(e, 0xD0);
+    emit8(e, 0xC0 | (ext << 3) | (rm & 7));
+}
+
+// MOVSX r32, r8
+void emit_movsx(jit_emitter_t *e, int reg, int rm)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, 0x0F);
+    emit8(e, 0xBE);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// SETcc r8
+void emit_setcc(jit_emitter_t *e, uint8_t cc, int rm)
+{
+    emit_rex(e, 0, rm);
+    emit8(e, 0x0F);
+    emit8(e, cc);
+    emit8(e, 0xC0 | (rm & 7));
+}
+
+// MOV r8, [rbx+disp32] (0x8A) or MOV [rbx+disp32], r8 (0x88)
+void emit_mem8(jit_emitter_t *e, uint8_t opcode, int reg, uint32_t disp)
+{
+    emit_rex(e, reg, RBX);
+    emit8(e, opcode);
+    emit8(e, 0x80 | ((reg & 7) << 3) | RBX);
+    emit32(e, disp);
+}
+
+// MOV WORD [rbx+disp32], imm16
+void emit_store16_imm(jit_emitter_t *e, uint32_t disp, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit8(e, 0x80 | RBX);
+    emit32(e, disp);
+    emit16(e, imm);
+}
+
+// <opcode> WORD [rbx+disp32], ax (MOV 0x89, ADD 0x01)
+void emit_mem16_ax(jit_emitter_t *e, uint8_t opcode, uint32_t disp)
+{
+    emit8(e, 0x66);
+    emit8(e, opcode);
+    emit8(e, 0x80 | RBX);
+    emit32(e, disp);
+}
+
+/** Translation **/
+
+// Guest registers a natively translated instruction works on, false if we leave it to dispatch()
+bool jit_native_operands(chip8_decoded_t d, uint16_t *regs)
+{
+    switch (d.op)
+    {
+    case OP_LD_BYTE: case OP_ADD_BYTE: case OP_SE_BYTE: case OP_SNE_BYTE:
+    case OP_ADD_I_VX: case OP_LD_F_VX: case OP_LD_VX_DT: case OP_LD_DT_VX: case OP_LD_ST_VX:
+        *regs = 1 << d.x;
+        return true;
+
+    case OP_LD_REG: case OP_OR: case OP_AND: case OP_XOR: case OP_SE_REG: case OP_SNE_REG:
+        *regs = (1 << d.x) | (1 << d.y);
+        return true;
+
+    case OP_ADD_REG: case OP_SUB: case OP_SUBN:
+        *regs = (1 << d.x) | (1 << d.y) | (1 << 0xF);
+        return true;
+
+    case OP_SHR: case OP_SHL:
+        *regs = (1 << d.x) | (1 << 0xF);
+        return true;
+
+    case OP_LD_I: case OP_JP: case OP_ERROR:
+        *regs = 0;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* Instructions a block ends with: anything that may not fall through to the next address, DRW and Fx0A so the
+   run loop can apply the usual stop rules, and writes to memory, which may have just changed the block itself */
+bool jit_ends_block(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_RET: case OP_SYS: case OP_JP: case OP_CALL: case OP_JP_V0:
+    case OP_SE_BYTE: case OP_SNE_BYTE: case OP_SE_REG: case OP_SNE_REG: case OP_SKP: case OP_SKNP:
+    case OP_DRW: case OP_LD_VX_K: case OP_LD_B_VX: case OP_LD_MEM_VX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void jit_load_registers(jit_emitter_t *e)
+{
+    for (int r = 0; r < 16; ++r)
+        if (e->host[r] != jit_no_register)
+            emit_mem8(e, 0x8A, e->host[r], offsetof(chip8_t, regs) + r);
+}
+
+void jit_store_registers(jit_emitter_t *e)
+{
+    for (int r = 0; r < 16; ++r)
+        if (e->host[r] != jit_no_register)
+            emit_mem8(e, 0x88, e->host[r], offsetof(chip8_t, regs) + r);
+}
+
+// Run the instruction at addr through dispatch(), which sees the guest registers in memory
+void jit_emit_fallback(jit_emitter_t *e, uint16_t addr)
+{
+    void (*fn)(chip8_t *) = dispatch;
+
+    jit_store_registers(e);
+    emit_store16_imm(e, offsetof(chip8_t, pc), addr);
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF);      // mov rdi, rbx
+    emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64_t)fn); // mov rax, dispatch
+    emit8(e, 0xFF); emit8(e, 0xD0);                      // call rax
+    jit_load_registers(e);
+}
+
+// pc = condition ? ecx : eax, with both candidates and the comparison flags already set up by the caller
+void jit_emit_skip(jit_emitter_t *e, uint8_t cmov)
+{
+    emit8(e, 0x0F); emit8(e, cmov); emit8(e, 0xC1);      // cmovcc eax, ecx
+    emit_mem16_ax(e, 0x89, offsetof(chip8_t, pc));       // mov [pc], ax
+}
+
+void jit_emit_instruction(jit_emitter_t *e, chip8_decoded_t d, uint16_t addr)
+{
+    uint16_t next = addr + sizeof(chip8_instruction_t);
+    int x = e->host[d.x];
+    int y = e->host[d.y];
+    int f = e->host[0xF];
+
+    switch (d.op)
+    {
+    case OP_LD_BYTE: emit_mov_ri8(e, x, d.kk); break;
+    case OP_ADD_BYTE: emit_ri8(e, 0, x, d.kk); break;
+    case OP_LD_REG: emit_rr8(e, 0x88, x, y); break;
+    case OP_OR: emit_rr8(e, 0x08, x, y); break;
+    case OP_AND: emit_rr8(e, 0x20, x, y); break;
+    case OP_XOR: emit_rr8(e, 0x30, x, y); break;
+
+    case OP_ADD_REG: // the sum is taken on the sign-extended registers, as op_add_reg() does
+        emit_movsx(e, RAX, x);
+        emit_movsx(e, RCX, y);
+        emit8(e, 0x01); emit8(e, 0xC8);                    // add eax, ecx
+        emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0xC0);    // movzx eax, ax
+        emit8(e, 0x3D); emit32(e, 0xFF);                   // cmp eax, 0xFF
+        emit_setcc(e, 0x97, f);                            // seta VF
+        emit_rr8(e, 0x88, x, RAX);                         // mov Vx, al
+        break;
+
+    case OP_SUB:
+    case OP_SUBN:
+        emit_movsx(e, RAX, d.op == OP_SUB ? x : y);
+        emit_movsx(e, RCX, d.op == OP_SUB ? y : x);
+        emit8(e, 0x29); emit8(e, 0xC8);                    // sub eax, ecx
+        emit8(e, 0x85); emit8(e, 0xC0);                    // test eax, eax
+        emit_setcc(e, d.op == OP_SUB ? 0x9E : 0x9F, f);    // setle/setg VF
+        emit_rr8(e, 0x88, x, RAX);                         // mov Vx, al
+        break;
+
+    case OP_SHR:
+        emit_rr8(e, 0x88, RAX, x);                         // mov al, Vx
+        emit_ri8(e, 4, RAX, 1);                            // and al, 1
+        emit_rr8(e, 0x88, f, RAX);                         // mov VF, al
+        emit_shift1(e, 7, x);                              // sar Vx, 1
+        break;
+
+    case OP_SHL: // op_shl() leaves 0x40 in VF for negative registers, which is bit 7 moved down to bit 6
+        emit_rr8(e, 0x88, RAX, x);                         // mov al, Vx
+        emit_shift1(e, 7, RAX);                            // sar al, 1
+        emit_ri8(e, 4, RAX, 0x40);                         // and al, 0x40
+        emit_rr8(e, 0x88, f, RAX);                         // mov VF, al
+        emit_shift1(e, 4, x);                              // shl Vx, 1
+        break;
+
+    case OP_LD_I:
+        emit_store16_imm(e, offsetof(chip8_t, I), d.nnn);
+        break;
+
+    case OP_ADD_I_VX:
+        emit_movsx(e, RAX, x);
+        emit_mem16_ax(e, 0x01, offsetof(chip8_t, I));      // add [I], ax
+        break;
+
+    case OP_LD_F_VX:
+        emit_movsx(e, RAX, x);
+        emit8(e, 0x8D); emit8(e, 0x84); emit8(e, 0x80);    // lea eax, [rax+rax*4+font]
+        emit32(e, default_font_offset);
+        emit_mem16_ax(e, 0x89, offsetof(chip8_t, I));      // mov [I], ax
+        break;
+
+    case OP_LD_VX_DT: emit_mem8(e, 0x8A, x, offsetof(chip8_t, dt)); break;
+    case OP_LD_DT_VX: emit_mem8(e, 0x88, x, offsetof(chip8_t, dt)); break;
+    case OP_LD_ST_VX: emit_mem8(e, 0x88, x, offsetof(chip8_t, st)); break;
+
+    case OP_JP:
+        emit_store16_imm(e, offsetof(chip8_t, pc), d.nnn);
+        break;
+
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+        emit8(e, 0xB8); emit32(e, next);                   // mov eax, next
+        emit8(e, 0xB9); emit32(e, next + 2);               // mov ecx, next + 2
+        emit_ri8(e, 7, x, d.kk);                           // cmp Vx, kk
+        jit_emit_skip(e, d.op == OP_SE_BYTE ? 0x44 : 0x45);
+        break;
+
+    case OP_SE_REG:
+    case OP_SNE_REG:
+        emit8(e, 0xB8); emit32(e, next);                   // mov eax, next
+        emit8(e, 0xB9); emit32(e, next + 2);               // mov ecx, next + 2
+        emit_rr8(e, 0x38, x, y);                           // cmp Vx, Vy
+        jit_emit_skip(e, d.op == OP_SE_REG ? 0x44 : 0x45);
+        break;
+
+    case OP_ERROR:
+        break;
+
+    default:
+        jit_emit_fallback(e, addr);
+        break;
+    }
+}
+
+/* Most bytes a block of length instructions, with nregs guest registers in host registers, can take: every
+   instruction may be a fallback that stores and reloads all of them, and the prologue and epilogue move them
+   once more */
+uint32_t jit_max_block_bytes(uint16_t length, int nregs)
+{
+    return (length + 1) * 2 * nregs * jit_register_bytes + length * jit_max_bytes_per_instruction +
+           jit_max_bytes_per_block;
+}
+
+void jit_flush(chip8_jit_t *j = &jit_context)
+{
+    j->code_used = 0;
+    memset(j->blocks, 0, sizeof(j->blocks));
+}
+
+// Translate the block starting at addr, false if it cannot be done and the caller has to interpret
+bool jit_compile(chip8_jit_t *j, chip8_t *c, uint16_t addr)
+{
+    if (j->unavailable || addr >= memory_size - 1)
+        return false;
+
+    if (!j->code)
+    {
+        void *p = mmap(NULL, jit_code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            j->unavailable = true;
+            return false;
+        }
+        j->code = (uint8_t *)p;
+    }
+
+    // Find out where the block ends and which guest registers it needs in host registers
+    chip8_decoded_t instructions[jit_max_block_length];
+    uint16_t length = 0;
+    uint16_t needed = 0;
+    for (uint16_t a = addr; length < jit_max_block_length && a < memory_size - 1; a += 2)
+    {
+        chip8_decoded_t d = *fetch_decoded(c, a);
+        uint16_t regs = 0;
+        if (jit_native_operands(d, &regs))
+        {
+            if (__builtin_popcount(needed | regs) > (int)sizeof(jit_allocatable))
+                break; // out of host registers, start a new block here
+            needed |= regs;
+        }
+        instructions[length++] = d;
+        if (jit_ends_block(d.op))
+            break;
+    }
+
+    if (j->code_used + jit_max_block_bytes(length, __builtin_popcount(needed)) > jit_code_size)
+        jit_flush(j);
+
+    if (mprotect(j->code, jit_code_size, PROT_READ | PROT_WRITE))
+    {
+        j->unavailable = true;
+        return false;
+    }
+
+    jit_emitter_t e;
+    e.p = j->code + j->code_used;
+    for (int r = 0, next = 0; r < 16; ++r)
+        e.host[r] = (needed >> r) & 1 ? jit_allocatable[next++] : jit_no_register;
+
+    uint8_t *start = e.p;
+
+    // Prologue: save callee-saved registers, keeping the stack 16B aligned for calls into dispatch()
+    emit8(&e, 0x53);                                      // push rbx
+    emit8(&e, 0x55);                                      // push rbp
+    emit8(&e, 0x41); emit8(&e, 0x54);                     // push r12
+    emit8(&e, 0x41); emit8(&e, 0x55);                     // push r13
+    emit8(&e, 0x41); emit8(&e, 0x56);                     // push r14
+    emit8(&e, 0x41); emit8(&e, 0x57);                     // push r15
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xEC); emit8(&e, 0x08); // sub rsp, 8
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB);    // mov rbx, rdi
+    emit8(&e, 0x41); emit8(&e, 0x89); emit8(&e, 0xF7);    // mov r15d, esi
+    jit_load_registers(&e);
+
+    // Body, counting the budget down after every instruction
+    uint8_t *exits[jit_max_block_length];
+    for (uint16_t k = 0; k < length; ++k)
+    {
+        uint16_t a = addr + k * sizeof(chip8_instruction_t);
+        jit_emit_instruction(&e, instructions[k], a);
+        emit8(&e, 0x41); emit8(&e, 0x83); emit8(&e, 0xEF); emit8(&e, 0x01); // sub r15d, 1
+        if (k + 1 < length)
+        {
+            emit8(&e, 0x0F); emit8(&e, 0x84);             // jz <exit stub>, patched below
+            exits[k] = e.p;
+            emit32(&e, 0);
+        }
+        else if (!jit_ends_block(instructions[k].op))
+        {
+            // we ran out of block without changing control flow, continue right after it
+            emit_store16_imm(&e, offsetof(chip8_t, pc), a + sizeof(chip8_instruction_t));
+        }
+    }
+
+    // Epilogue: write the guest registers back and return the budget left
+    uint8_t *epilogue = e.p;
+    jit_store_registers(&e);
+    emit8(&e, 0x44); emit8(&e, 0x89); emit8(&e, 0xF8);    // mov eax, r15d
+    emit8(&e, 0x48); emit8(&e, 0x83); emit8(&e, 0xC4); emit8(&e, 0x08); // add rsp, 8
+    emit8(&e, 0x41); emit8(&e, 0x5F);                     // pop r15
+    emit8(&e, 0x41); emit8(&e, 0x5E);                     // pop r14
+    emit8(&e, 0x41); emit8(&e, 0x5D);                     // pop r13
+    emit8(&e, 0x41); emit8(&e, 0x5C);                     // pop r12
+    emit8(&e, 0x5D);                                      // pop rbp
+    emit8(&e, 0x5B);                                      // pop rbx
+    emit8(&e, 0xC3);                                      // ret
+
+    // Exit stubs for running out of budget in the middle of the block
+    for (uint16_t k = 0; k + 1 < length; ++k)
+    {
+        uint32_t rel = (uint32_t)(e.p - (exits[k] + 4));
+        memcpy(exits[k], &rel, 4);
+        emit_store16_imm(&e, offsetof(chip8_t, pc), addr + (k + 1) * sizeof(chip8_instruction_t));
+        emit8(&e, 0xE9);                                  // jmp epilogue
+        emit32(&e, (uint32_t)(epilogue - (e.p + 4)));
+    }
+
+    j->code_used += e.p - start;
+    if (mprotect(j->code, jit_code_size, PROT_READ | PROT_EXEC))
+    {
+        j->unavailable = true;
+        return false;
+    }
+
+    jit_block_t *b = &j->blocks[addr];
+    b->code = (jit_code_f *)start;
+    b->length = length;
+    b->last_addr = addr + (length - 1) * sizeof(chip8_instruction_t);
+    b->last_op = instructions[length - 1].op;
+    return true;
+}
+
+// Same contract as the other engines
+uint32_t run_jit(chip8_t *c, uint32_t budget)
+{
+    chip8_jit_t *j = &jit_context;
+    if (j->code_epoch != c->code_epoch)
+    {
+        // another machine, or the ROM wrote over its code
+        jit_flush(j);
+        j->code_epoch = c->code_epoch;
+    }
+
+    uint32_t executed = 0;
+    while (executed < budget)
+    {
+        uint16_t pc = c->pc;
+        jit_block_t *b = pc < memory_size ? &j->blocks[pc] : NULL;
+
+        if (b && (b->code || jit_compile(j, c, pc)))
+        {
+            uint32_t left = budget - executed;
+            uint32_t ran = left - b->code(c, left);
+            executed += ran;
+
+            if (ran == b->length)
+            {
+                if (engine_stops_after(c, b->last_op, b->last_addr))
+                    break;
+            }
+        }
+        else
+        {
+            // nothing to translate here, interpret a single instruction instead
+            uint8_t op = fetch_decoded(c, pc)->op;
+            dispatch(c);
+            ++executed;
+            if (engine_stops_after(c, op, pc))
+                break;
+        }
+
+        if (j->code_epoch != c->code_epoch)
+        {
+            jit_flush(j);
+            j->code_epoch = c->code_epoch;
+        }
+    }
+    return executed;
+}
+
+#else
+
+// No recompiler for this host, the threaded engine is the next best thing
+uint32_t run_jit(chip8_t *c, uint32_t budget)
+{
+    return run_threaded(c, budget);
+}
+
+#endif
+
+#endif
@@ -21,3 +21,12 @@
 /* The "end simulation" key. Since we read 1-byte-at-a-time at the moment,
    ESC (27) is not a great choice, since many keys get translated into ESC+more bytes */
 #define CHIP8_KEY_END 'K'
+
+/* Emulator hotkeys, also single characters that must not clash with the keys above */
+// Toggle turbo: run as fast as the host allows
+#define CHIP8_KEY_TURBO 'T'
+// Save the machine to <rom>.state, and load it back
+#define CHIP8_KEY_SAVE_STATE 'P'
+#define CHIP8_KEY_LOAD_STATE 'L'
+// Go back one frame in the rewind history
+#define CHIP8_KEY_REWIND 'B'
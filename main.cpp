@@ -1,32 +1,159 @@
 #include "disassembler.hpp"
+#include "analyzer.hpp"
+#include "recompiler.hpp"
 #include "runtime.cpp"
+#include "batch.hpp"
+#include "replay.hpp"
 
 void print_help()
 {
-    fprintf(stderr, "Usage:\n\tchipperino -d <file>\n\tchipperino -e <file>\n");
+    fprintf(stderr, "Usage:\n\tchipperino -d <file>\n");
+    fprintf(stderr, "\tchipperino -a <file>\n");
+    fprintf(stderr, "\tchipperino -c <file> [<output.cpp>]\n");
+    fprintf(stderr, "\tchipperino -e [-i <engine>] [-p <instructions per frame>] [-s <spin usecs>] [-u] [-r <rewind MB>] [-R <recording>] [-F <profile> | -T <trace>] <file>\n");
+    fprintf(stderr, "\tchipperino -P <recording> [-i <engine>] <file>\n");
+    fprintf(stderr, "\tchipperino -b [-i <engine>] [-n <cycles> | -f <frames>] [-j <threads>] [-F <profile> | -T <trace>] <files, directories or packs>\n");
+    fprintf(stderr, "\tchipperino -t <trace>\n");
+    fprintf(stderr, "\tchipperino -k <pack> <files or directories>\n");
+    fprintf(stderr, "-u starts in turbo mode, which can also be toggled with '%c' while running\n", CHIP8_KEY_TURBO);
+    fprintf(stderr, "-r sets the memory kept for rewinding with '%c' (16 MB by default, 0 turns it off)\n", CHIP8_KEY_REWIND);
+    fprintf(stderr, "-R saves the keys played to a recording, -P plays one back headless as fast as possible\n");
+    fprintf(stderr, "-F profiles the guest: hottest addresses, opcode mix, calls and time spent waiting are saved to\n"
+                    "   <profile>, and folded stacks for flamegraph tools to <profile>.folded\n");
+    fprintf(stderr, "-T saves every instruction run to a binary trace (-b makes one per ROM, <trace>.<index>),\n"
+                    "   -t prints one through the disassembler\n");
+    fprintf(stderr, "-a follows the ROM's control flow to list its basic blocks, call graph and which bytes are code or data\n");
+    fprintf(stderr, "-c translates the ROM into C++ that builds into a program running only that ROM, see aot.hpp\n");
+    fprintf(stderr, "-k puts many ROMs in a single pack file, which -b runs like a directory\n");
+    fprintf(stderr, "Engines:\n\tswitch (default), threaded, jit\n");
 }
 
 int main(int argc, char *argv[])
 {
     char *filename = NULL;
-    enum { NONE, DISASSEMBLE, EXECUTE };
+    std::vector<char *> filenames;
+    enum { NONE, DISASSEMBLE, ANALYZE, COMPILE, DECODE_TRACE, EXECUTE, BATCH, REPLAY, PACK };
     int action = NONE;
+    engine_f *engine = run_switch;
+    uint64_t cycles = batch_default_frames * batch_instructions_per_frame;
+    unsigned threads = 0;
+    runtime_config_t config;
+    char *recording_filename = NULL;
+    char *pack_filename = NULL;
+    char *profile_filename = NULL;
+    char *trace_filename = NULL;
     
     for (int i = 1; i < argc; ++i)
     {
+        if (!strcmp("-i", argv[i]) && i + 1 < argc)
+        {
+            // the next arg is the engine name, not a filename
+            engine = engine_by_name(argv[++i]);
+            if (!engine)
+            {
+                fprintf(stderr, "Unknown engine '%s'\n", argv[i]);
+                print_help();
+                return 1;
+            }
+            continue;
+        }
+        if (!strcmp("-n", argv[i]) && i + 1 < argc)
+        {
+            cycles = strtoull(argv[++i], NULL, 0);
+            continue;
+        }
+        if (!strcmp("-f", argv[i]) && i + 1 < argc)
+        {
+            cycles = strtoull(argv[++i], NULL, 0) * batch_instructions_per_frame;
+            continue;
+        }
+        if (!strcmp("-p", argv[i]) && i + 1 < argc)
+        {
+            config.instructions_per_frame = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
+        if (!strcmp("-s", argv[i]) && i + 1 < argc)
+        {
+            config.spin_ns = strtoll(argv[++i], NULL, 0) * 1000;
+            continue;
+        }
+        if (!strcmp("-r", argv[i]) && i + 1 < argc)
+        {
+            config.rewind_budget = strtoull(argv[++i], NULL, 0) << 20;
+            continue;
+        }
+        if (!strcmp("-R", argv[i]) && i + 1 < argc)
+        {
+            config.record_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp("-F", argv[i]) && i + 1 < argc)
+        {
+            profile_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp("-T", argv[i]) && i + 1 < argc)
+        {
+            trace_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp("-P", argv[i]) && i + 1 < argc)
+        {
+            action = REPLAY;
+            recording_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp("-k", argv[i]) && i + 1 < argc)
+        {
+            action = PACK;
+            pack_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp("-j", argv[i]) && i + 1 < argc)
+        {
+            threads = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
         if (argv[i][0] != '-')
         {
             // if not preceded by '-', assume arg is the target filename
             filename = argv[i];
+            filenames.push_back(argv[i]);
         }
         if (!strcmp("-d", argv[i]))
         {
             action = DISASSEMBLE;
         }
+        if (!strcmp("-a", argv[i]))
+        {
+            action = ANALYZE;
+        }
+        if (!strcmp("-c", argv[i]))
+        {
+            action = COMPILE;
+        }
+        if (!strcmp("-t", argv[i]))
+        {
+            action = DECODE_TRACE;
+        }
         if (!strcmp("-e", argv[i]))
         {
             action = EXECUTE;
         }
+        if (!strcmp("-u", argv[i]))
+        {
+            config.turbo = true;
+        }
+        if (!strcmp("-b", argv[i]))
+        {
+            action = BATCH;
+        }
+    }
+
+    if (profile_filename && trace_filename)
+    {
+        fprintf(stderr, "-F and -T cannot be used together\n");
+        return 1;
     }
 
     switch (action)
@@ -35,10 +162,52 @@ int main(int argc, char *argv[])
         disassemble(filename);
         break;
 
+    case ANALYZE:
+        analyze(filename);
+        break;
+
+    case COMPILE:
+        if (filenames.empty())
+        {
+            print_help();
+            return 1;
+        }
+        return recompile(filenames[0], filenames.size() > 1 ? filenames[1] : NULL);
+
+    case DECODE_TRACE:
+        if (!filename)
+        {
+            print_help();
+            return 1;
+        }
+        return print_trace(filename);
+
     case EXECUTE:
-        execute(filename);
+        config.engine = engine;
+        config.profile_filename = profile_filename;
+        config.trace_filename = trace_filename;
+        execute(filename, &config);
+        break;
+
+    case REPLAY:
+        return replay_recording(filename, recording_filename, engine);
+
+    case BATCH:
+        run_batch(filenames, engine, cycles, threads, profile_filename, trace_filename);
         break;
         
+    case PACK:
+    {
+        int packed = write_pack(pack_filename, collect_roms(filenames));
+        if (packed < 0)
+        {
+            fprintf(stderr, "Could not write '%s': %s\n", pack_filename, strerror(errno));
+            return 1;
+        }
+        printf("Packed %d ROMs into '%s'\n", packed, pack_filename);
+        break;
+    }
+
     case NONE:
         print_help();
         return 1;
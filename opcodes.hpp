@@ -0,0 +1,149 @@
+#ifndef CHIPPERINO_OPCODES_H
+#define CHIPPERINO_OPCODES_H
+#include <stdint.h>
+#include <string_view>
+
+#include "architecture.hpp"
+
+/** Opcode table **/
+
+/* Every CHIP8 instruction is described once, here, and everything that needs to recognise instructions (the
+   interpreter's decode(), the disassembler) looks them up in this table instead of taking nibbles apart itself */
+
+// Which operands an instruction takes, and so which of its nibbles mean something
+enum chip8_operands_t : uint8_t {
+    OPERANDS_NONE,
+    OPERANDS_NNN, // addr
+    OPERANDS_X,   // Vx
+    OPERANDS_XKK, // Vx, byte
+    OPERANDS_XY,  // Vx, Vy
+    OPERANDS_XYN, // Vx, Vy, nibble
+};
+
+struct opcode_t {
+    uint16_t pattern; // the bits that identify the instruction...
+    uint16_t mask;    // ...and where they are
+    chip8_op_t op;
+    chip8_operands_t operands;
+    std::string_view mnemonic;
+    std::string_view summary;
+};
+
+/* NOTE: entries must be grouped by their top nibble in ascending order. Within a group the first entry that
+   matches wins, so more specific patterns go before the ones they overlap with */
+constexpr opcode_t opcode_table[] = {
+    // 0x00?0 and 0x00?E are taken as CLS and RET, like they have always been
+    { 0x0000, 0xFF0F, OP_CLS,       OPERANDS_NONE, "CLS",                "clear the display" },
+    { 0x000E, 0xFF0F, OP_RET,       OPERANDS_NONE, "RET",                "return from a subroutine" },
+    { 0x0000, 0xFF00, OP_ERROR,     OPERANDS_NONE, "error",              "unknown function" },
+    { 0x0000, 0xF000, OP_SYS,       OPERANDS_NNN,  "SYS addr",           "jump to machine code routine at nnn" },
+    { 0x1000, 0xF000, OP_JP,        OPERANDS_NNN,  "JP addr",            "jump to location nnn" },
+    { 0x2000, 0xF000, OP_CALL,      OPERANDS_NNN,  "CALL addr",          "call subroutine at location nnn" },
+    { 0x3000, 0xF000, OP_SE_BYTE,   OPERANDS_XKK,  "SE Vx, byte",        "skip next instruction if Vx = kk" },
+    { 0x4000, 0xF000, OP_SNE_BYTE,  OPERANDS_XKK,  "SNE Vx, byte",       "skip next instruction if Vx != kk" },
+    // NOTE: the lowest nibble of 5xy0 has never been checked
+    { 0x5000, 0xF000, OP_SE_REG,    OPERANDS_XY,   "SE Vx, Vy",          "skip next instruction if Vx == Vy" },
+    { 0x6000, 0xF000, OP_LD_BYTE,   OPERANDS_XKK,  "LD Vx, byte",        "put value kk into register Vx" },
+    { 0x7000, 0xF000, OP_ADD_BYTE,  OPERANDS_XKK,  "ADD Vx, byte",       "adds value kk to register Vx and stores result in Vx" },
+    { 0x8000, 0xF00F, OP_LD_REG,    OPERANDS_XY,   "LD Vx, Vy",          "stores the value of register Vy in register Vx" },
+    { 0x8001, 0xF00F, OP_OR,        OPERANDS_XY,   "OR Vx, Vy",          "bitwise OR of Vx and Vy storing result in Vx" },
+    { 0x8002, 0xF00F, OP_AND,       OPERANDS_XY,   "AND Vx, Vy",         "bitwise AND of Vx and Vy storing result in Vx" },
+    { 0x8003, 0xF00F, OP_XOR,       OPERANDS_XY,   "XOR Vx, Vy",         "bitwise XOR of Vx and Vy storing result in Vx" },
+    { 0x8004, 0xF00F, OP_ADD_REG,   OPERANDS_XY,   "ADD Vx, Vy",         "adds values inside Vx and Vy storing result in Vx" },
+    { 0x8005, 0xF00F, OP_SUB,       OPERANDS_XY,   "SUB Vx, Vy",         "subtracts value of Vy from Vx storing result in Vx" },
+    { 0x8006, 0xF00F, OP_SHR,       OPERANDS_XY,   "SHR Vx {, Vy}",      "shift right the contents of Vx" },
+    { 0x8007, 0xF00F, OP_SUBN,      OPERANDS_XY,   "SUBN Vx {, Vy}",     "subtracts value of Vx from Vy storing result in Vx" },
+    { 0x800E, 0xF00F, OP_SHL,       OPERANDS_XY,   "SHL Vx {, Vy}",      "shift left the contents of Vx" },
+    // NOTE: the lowest nibble of 9xy0 has never been checked either
+    { 0x9000, 0xF000, OP_SNE_REG,   OPERANDS_XY,   "SNE Vx, Vy",         "skip next instruction if Vx != Vy" },
+    { 0xA000, 0xF000, OP_LD_I,      OPERANDS_NNN,  "LD I, addr",         "set I = nnn" },
+    { 0xB000, 0xF000, OP_JP_V0,     OPERANDS_NNN,  "JP V0, addr",        "jump to location nnn + V0" },
+    { 0xC000, 0xF000, OP_RND,       OPERANDS_XKK,  "RND Vx, byte",       "set Vx = random byte AND kk" },
+    { 0xD000, 0xF000, OP_DRW,       OPERANDS_XYN,  "DRW Vx, Vy, nibble", "display n-byte sprite starting at I at (Vx, Vy)" },
+    { 0xE09E, 0xF0FF, OP_SKP,       OPERANDS_X,    "SKP Vx",             "skip next instruction if key with value of Vx is pressed" },
+    { 0xE0A1, 0xF0FF, OP_SKNP,      OPERANDS_X,    "SKNP Vx",            "skip next instruction if key with value of Vx is not pressed" },
+    { 0xF007, 0xF0FF, OP_LD_VX_DT,  OPERANDS_X,    "LD Vx, DT",          "the value of DT is placed at Vx" },
+    { 0xF00A, 0xF0FF, OP_LD_VX_K,   OPERANDS_X,    "LD Vx, K",           "wait for keypress storing the value at Vx" },
+    { 0xF015, 0xF0FF, OP_LD_DT_VX,  OPERANDS_X,    "LD DT, Vx",          "the value of Vx is placed at DT" },
+    { 0xF018, 0xF0FF, OP_LD_ST_VX,  OPERANDS_X,    "LD ST, Vx",          "the value of Vx is placed at ST" },
+    { 0xF01E, 0xF0FF, OP_ADD_I_VX,  OPERANDS_X,    "ADD I, Vx",          "the values of Vx and I are added and stored at I" },
+    { 0xF029, 0xF0FF, OP_LD_F_VX,   OPERANDS_X,    "LD F, Vx",           "the value of I is set to the location of the sprite at Vx" },
+    { 0xF033, 0xF0FF, OP_LD_B_VX,   OPERANDS_X,    "LD B, Vx",           "store the hundreds digit of Vx at I, tenths at I+1, units at I+2" },
+    { 0xF055, 0xF0FF, OP_LD_MEM_VX, OPERANDS_X,    "LD [I], Vx",         "store registers V0 through Vx in memory at address I" },
+    { 0xF065, 0xF0FF, OP_LD_VX_MEM, OPERANDS_X,    "LD Vx, [I]",         "read memory at address I to registers from V0 to Vx" },
+};
+
+const size_t opcode_count = sizeof(opcode_table) / sizeof(opcode_table[0]);
+
+// What anything that is not in the table decodes to
+constexpr opcode_t opcode_error = { 0x0000, 0x0000, OP_ERROR, OPERANDS_NONE, "error", "unknown function" };
+
+// Where the entries for every top nibble start, so a lookup only looks at its own group
+struct opcode_index_t {
+    uint8_t first[17];
+};
+
+constexpr opcode_index_t build_opcode_index()
+{
+    opcode_index_t index = {};
+    size_t i = 0;
+    for (unsigned nibble = 0; nibble < 16; ++nibble)
+    {
+        index.first[nibble] = i;
+        while (i < opcode_count && (opcode_table[i].pattern >> 12) == nibble)
+            ++i;
+    }
+    index.first[16] = i;
+    return index;
+}
+
+constexpr opcode_index_t opcode_index = build_opcode_index();
+
+// If the table was not grouped by top nibble some entries would be left out of the index
+static_assert(opcode_index.first[16] == opcode_count);
+
+constexpr const opcode_t *find_opcode(uint16_t instruction)
+{
+    unsigned nibble = instruction >> 12;
+    for (unsigned i = opcode_index.first[nibble]; i < opcode_index.first[nibble + 1]; ++i)
+        if ((instruction & opcode_table[i].mask) == opcode_table[i].pattern)
+            return &opcode_table[i];
+    return &opcode_error;
+}
+
+// The table entry of a handler id, for naming it
+constexpr const opcode_t *opcode_of(chip8_op_t op)
+{
+    for (const opcode_t &o : opcode_table)
+        if (o.op == op)
+            return &o;
+    return &opcode_error;
+}
+
+// Every handler has to be reachable from exactly one table entry
+constexpr bool every_op_in_table()
+{
+    for (unsigned op = OP_UNDECODED + 1; op < OP_ERROR; ++op)
+    {
+        int found = 0;
+        for (const opcode_t &o : opcode_table)
+            found += o.op == op;
+        if (found != 1)
+            return false;
+    }
+    return true;
+}
+
+static_assert(every_op_in_table());
+static_assert(find_opcode(0x00E0)->op == OP_CLS && find_opcode(0x00EE)->op == OP_RET);
+static_assert(find_opcode(0x00E1)->op == OP_ERROR && find_opcode(0x0123)->op == OP_SYS);
+static_assert(find_opcode(0x8AB6)->op == OP_SHR && find_opcode(0x8AB8)->op == OP_ERROR);
+static_assert(find_opcode(0xF165)->op == OP_LD_VX_MEM && find_opcode(0xF166)->op == OP_ERROR);
+
+// The instruction word at i, with the msb first like in the opcode table
+constexpr uint16_t instruction_word(chip8_instruction_t i)
+{
+    return (i.msb << 8) | i.lsb;
+}
+
+#endif
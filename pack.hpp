@@ -0,0 +1,276 @@
+#ifndef CHIPPERINO_PACK_H
+#define CHIPPERINO_PACK_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "architecture.hpp"
+#include "utils.hpp"
+#include "rom.hpp"
+#include "savestate.hpp"
+
+/* ROM packs: many ROMs in a single file, so a corpus can be opened once and mapped instead of opening, reading
+   and closing thousands of tiny files. Little endian throughout:
+
+       header     magic "CH8K", u16 version, u16 reserved, u32 count
+       directory  count entries sorted by name hash: u64 name hash, u64 ROM hash, u32 name offset,
+                  u16 name length, u32 data offset, u16 size
+       by hash    count u32 directory indices, sorted by ROM hash
+       names, then ROM data, wherever the directory says
+
+   Name hashes are hash_bytes() of the name and ROM hashes are rom_hash() of the contents, the same hash input
+   recordings store. Every offset is checked once when the pack is opened, so lookups trust them */
+
+const char pack_magic[4] = { 'C', 'H', '8', 'K' };
+const uint16_t pack_version = 1;
+const size_t pack_header_size = 4 + 2 + 2 + 4;
+const size_t pack_entry_size = 8 + 8 + 4 + 2 + 4 + 2;
+
+struct rom_pack_t {
+    mapped_file_t file = {};
+    uint32_t count = 0;
+    const uint8_t *directory = NULL;
+    const uint8_t *by_hash = NULL;
+};
+
+struct packed_rom_t {
+    std::string_view name;
+    uint64_t hash;
+    const uint8_t *data; // straight from the mapped pack
+    uint16_t size;
+};
+
+void close_pack(rom_pack_t *p)
+{
+    unmap_file(&p->file);
+    p->count = 0;
+}
+
+// Entry index of the directory
+packed_rom_t packed_rom(const rom_pack_t *p, uint32_t index)
+{
+    const uint8_t *e = p->directory + (size_t)index * pack_entry_size;
+    uint64_t name_hash, hash;
+    uint32_t name_offset, data_offset;
+    uint16_t name_length, size;
+    e = get_u64(e, &name_hash);
+    e = get_u64(e, &hash);
+    e = get_u32(e, &name_offset);
+    e = get_u16(e, &name_length);
+    e = get_u32(e, &data_offset);
+    e = get_u16(e, &size);
+    return { std::string_view((const char *)p->file.data + name_offset, name_length), hash,
+             p->file.data + data_offset, size };
+}
+
+uint64_t packed_name_hash(const rom_pack_t *p, uint32_t index)
+{
+    uint64_t hash;
+    get_u64(p->directory + (size_t)index * pack_entry_size, &hash);
+    return hash;
+}
+
+uint32_t packed_index_by_hash(const rom_pack_t *p, uint32_t n)
+{
+    uint32_t index;
+    get_u32(p->by_hash + (size_t)n * 4, &index);
+    return index;
+}
+
+// Returns 0 on success, -1 with errno set otherwise (EINVAL if the file is not a pack we can read)
+int open_pack(rom_pack_t *p, const char *filename)
+{
+    if (map_file(&p->file, filename))
+        return -1;
+
+    const uint8_t *data = p->file.data;
+    size_t size = p->file.size;
+    uint16_t version;
+    if (size < pack_header_size || memcmp(data, pack_magic, sizeof(pack_magic)))
+        goto invalid;
+    get_u16(data + sizeof(pack_magic), &version);
+    if (version != pack_version)
+        goto invalid;
+    get_u32(data + 8, &p->count);
+    if ((size - pack_header_size) / (pack_entry_size + 4) < p->count)
+        goto invalid;
+    p->directory = data + pack_header_size;
+    p->by_hash = p->directory + (size_t)p->count * pack_entry_size;
+
+    for (uint32_t i = 0; i < p->count; ++i)
+    {
+        const uint8_t *e = p->directory + (size_t)i * pack_entry_size + 16;
+        uint32_t name_offset, data_offset;
+        uint16_t name_length, rom_size;
+        e = get_u32(e, &name_offset);
+        e = get_u16(e, &name_length);
+        e = get_u32(e, &data_offset);
+        e = get_u16(e, &rom_size);
+        if ((size_t)name_offset + name_length > size || (size_t)data_offset + rom_size > size ||
+            rom_size > max_rom_size || packed_index_by_hash(p, i) >= p->count ||
+            (i && packed_name_hash(p, i - 1) > packed_name_hash(p, i)))
+            goto invalid;
+    }
+    return 0;
+
+invalid:
+    close_pack(p);
+    errno = EINVAL;
+    return -1;
+}
+
+// Look a ROM up by the name it was packed with. Returns false if there is none
+bool find_packed_rom(const rom_pack_t *p, std::string_view name, packed_rom_t *out)
+{
+    uint64_t hash = hash_bytes((const uint8_t *)name.data(), name.size());
+    uint32_t lo = 0, hi = p->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (packed_name_hash(p, mid) < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // names that share a hash sit next to each other
+    for (; lo < p->count && packed_name_hash(p, lo) == hash; ++lo)
+    {
+        *out = packed_rom(p, lo);
+        if (out->name == name)
+            return true;
+    }
+    return false;
+}
+
+// Look a ROM up by the hash of its contents, as stored in recordings. Returns false if there is none
+bool find_packed_rom(const rom_pack_t *p, uint64_t hash, packed_rom_t *out)
+{
+    uint32_t lo = 0, hi = p->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (packed_rom(p, packed_index_by_hash(p, mid)).hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == p->count)
+        return false;
+    *out = packed_rom(p, packed_index_by_hash(p, lo));
+    return out->hash == hash;
+}
+
+// Returns the number of bytes loaded, like load_rom()
+int load_packed_rom(chip8_t *c, const packed_rom_t *rom)
+{
+    // sizes were checked when the pack was opened
+    load_program(c, rom->data, rom->size);
+    return rom->size;
+}
+
+/* Pack every file in roms into a new pack at filename, named as they are given. Files that cannot be read or
+   do not fit in memory are left out with a warning. Returns the number of ROMs packed, or -1 with errno set */
+int write_pack(const char *filename, const std::vector<std::string> &roms)
+{
+    struct pending_t {
+        std::string name;
+        uint64_t name_hash;
+        uint64_t hash;
+        uint32_t data_offset;
+        std::vector<uint8_t> data;
+    };
+    std::vector<pending_t> pending;
+    for (const std::string &name : roms)
+    {
+        mapped_file_t f;
+        if (map_file(&f, name.c_str()))
+        {
+            fprintf(stderr, "Leaving out '%s': %s\n", name.c_str(), strerror(errno));
+            continue;
+        }
+        if (f.size > max_rom_size || name.size() > 0xFFFF)
+        {
+            fprintf(stderr, "Leaving out '%s': %s\n", name.c_str(), strerror(EFBIG));
+            unmap_file(&f);
+            continue;
+        }
+        pending.push_back({ name, hash_bytes((const uint8_t *)name.data(), name.size()), hash_bytes(f.data, f.size),
+                            0, std::vector<uint8_t>(f.data, f.data + f.size) });
+        unmap_file(&f);
+    }
+    std::stable_sort(pending.begin(), pending.end(),
+                     [](const pending_t &a, const pending_t &b) { return a.name_hash < b.name_hash; });
+
+    uint32_t count = pending.size();
+    size_t names_offset = pack_header_size + (size_t)count * (pack_entry_size + 4);
+    size_t total = names_offset;
+    for (pending_t &r : pending)
+        total += r.name.size();
+    for (pending_t &r : pending)
+    {
+        r.data_offset = total;
+        total += r.data.size();
+    }
+    if (total > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    std::vector<uint8_t> buffer(total);
+    uint8_t *p = buffer.data();
+    memcpy(p, pack_magic, sizeof(pack_magic));
+    p += sizeof(pack_magic);
+    p = put_u16(p, pack_version);
+    p = put_u16(p, 0);
+    p = put_u32(p, count);
+
+    size_t name_offset = names_offset;
+    for (pending_t &r : pending)
+    {
+        p = put_u64(p, r.name_hash);
+        p = put_u64(p, r.hash);
+        p = put_u32(p, name_offset);
+        p = put_u16(p, r.name.size());
+        p = put_u32(p, r.data_offset);
+        p = put_u16(p, r.data.size());
+        memcpy(&buffer[name_offset], r.name.data(), r.name.size());
+        memcpy(&buffer[r.data_offset], r.data.data(), r.data.size());
+        name_offset += r.name.size();
+    }
+
+    std::vector<uint32_t> by_hash(count);
+    for (uint32_t i = 0; i < count; ++i)
+        by_hash[i] = i;
+    std::stable_sort(by_hash.begin(), by_hash.end(),
+                     [&](uint32_t a, uint32_t b) { return pending[a].hash < pending[b].hash; });
+    for (uint32_t index : by_hash)
+        p = put_u32(p, index);
+
+    FILE *file_handle = fopen(filename, "wb");
+    if (!file_handle)
+        return -1;
+    size_t written = fwrite(buffer.data(), 1, buffer.size(), file_handle);
+    if (fclose(file_handle) || written != buffer.size())
+        return -1;
+    return count;
+}
+
+// Whether filename starts like a pack, so it can be told apart from a ROM
+bool is_pack_file(const char *filename)
+{
+    char magic[sizeof(pack_magic)];
+    FILE *file_handle = fopen(filename, "rb");
+    if (!file_handle)
+        return false;
+    size_t n = fread(magic, 1, sizeof(magic), file_handle);
+    fclose(file_handle);
+    return n == sizeof(magic) && !memcmp(magic, pack_magic, sizeof(magic));
+}
+
+#endif
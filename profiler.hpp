@@ -0,0 +1,285 @@
+#ifndef CHIPPERINO_PROFILER_H
+#define CHIPPERINO_PROFILER_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "architecture.hpp"
+#include "opcodes.hpp"
+#include "dispatch.hpp"
+#include "disassembler.hpp"
+
+/* Guest profiler: what a ROM spends its instructions on, counted by the interpreter as it runs them. Profiling
+   swaps the engine for run_profiled(), the reference engine plus the counters, so it costs nothing when off
+   and the numbers do not depend on the engine picked, all of them run the same instructions.
+
+   Besides counts per address, handler and call target, it keeps a call tree built from CALL and RET, so the
+   instructions can be charged to the stack of calls that ran them, and notices the two ways ROMs wait: Fx0A,
+   and spinning on LD Vx, DT until it reads 0 (see is_dt_wait_loop()) */
+
+// A node of the call tree: a function, reached through the calls of its parents
+struct profile_node_t {
+    uint32_t parent;
+    uint16_t addr;      // of the function
+    uint8_t depth;
+    uint64_t samples;   // instructions run in it, not counting its callees
+};
+
+enum profile_state_t : uint8_t {
+    PROFILE_RUNNING,
+    PROFILE_KEY_WAIT,   // last instruction was an Fx0A still waiting
+    PROFILE_DT_WAIT,    // last instruction was part of a DT wait loop
+};
+
+struct profile_t {
+    uint64_t instructions;
+    uint64_t frames;
+    uint64_t pc_counts[memory_size];
+    uint64_t outside_memory;           // run with pc past the end of memory, after a Bnnn went there
+    uint64_t op_counts[OP_COUNT];
+    uint64_t call_counts[memory_size]; // by target
+    uint64_t key_wait_polls;           // Fx0A executed with no key to take
+    uint64_t key_wait_frames;          // frames that ended waiting in Fx0A
+    uint64_t dt_wait_instructions;     // run in DT wait loops before DT ran out
+    uint64_t dt_wait_frames;           // frames that ended inside one
+    profile_state_t state;
+    uint16_t dt_loop;                  // the loop state is PROFILE_DT_WAIT for
+
+    std::vector<profile_node_t> tree;  // tree[0] is the code outside any call
+    std::unordered_map<uint32_t, uint32_t> children; // parent << 16 | function -> node
+    uint32_t current;
+};
+
+// The profile run_profiled() counts into, on this thread
+thread_local profile_t *profile_context = NULL;
+
+void start_profile(profile_t *p)
+{
+    p->instructions = p->frames = p->outside_memory = 0;
+    memset(p->pc_counts, 0, sizeof(p->pc_counts));
+    memset(p->op_counts, 0, sizeof(p->op_counts));
+    memset(p->call_counts, 0, sizeof(p->call_counts));
+    p->key_wait_polls = p->key_wait_frames = 0;
+    p->dt_wait_instructions = p->dt_wait_frames = 0;
+    p->state = PROFILE_RUNNING;
+    p->tree.assign(1, { 0, program_offset, 0, 0 });
+    p->children.clear();
+    p->current = 0;
+}
+
+void profile_call(profile_t *p, uint16_t target)
+{
+    // deeper than the machine's own stack means it has overflowed, keep charging the caller
+    if (p->tree[p->current].depth >= 16)
+        return;
+    uint32_t key = (p->current << 16) | target;
+    auto it = p->children.find(key);
+    if (it == p->children.end())
+    {
+        p->tree.push_back({ p->current, target, (uint8_t)(p->tree[p->current].depth + 1), 0 });
+        it = p->children.emplace(key, p->tree.size() - 1).first;
+    }
+    p->current = it->second;
+}
+
+// Count the instruction d, which was at pc and has just run
+void profile_instruction(profile_t *p, chip8_t *c, uint16_t pc, chip8_decoded_t d)
+{
+    ++p->instructions;
+    if (pc < memory_size)
+        ++p->pc_counts[pc];
+    else
+        ++p->outside_memory;
+    ++p->op_counts[d.op];
+    ++p->tree[p->current].samples;
+
+    bool in_dt_loop = p->state == PROFILE_DT_WAIT && pc >= p->dt_loop && pc <= p->dt_loop + 4;
+    p->state = PROFILE_RUNNING;
+    switch (d.op)
+    {
+    case OP_CALL:
+        ++p->call_counts[d.nnn];
+        profile_call(p, d.nnn);
+        break;
+    case OP_RET:
+        if (p->current)
+            p->current = p->tree[p->current].parent;
+        break;
+    case OP_LD_VX_DT:
+        // reading 0 ends the wait, that read is not part of it
+        in_dt_loop = c->regs[d.x] && is_dt_wait_loop(c, pc);
+        p->dt_loop = pc;
+        break;
+    case OP_LD_VX_K:
+        if (c->pc == pc)
+        {
+            ++p->key_wait_polls;
+            p->state = PROFILE_KEY_WAIT;
+        }
+        break;
+    default:
+        break;
+    }
+    if (in_dt_loop)
+    {
+        ++p->dt_wait_instructions;
+        p->state = PROFILE_DT_WAIT;
+    }
+    // back at the top level, whatever the tree thought (a state was loaded, the ROM played with the stack...)
+    if (!c->sp)
+        p->current = 0;
+}
+
+// Called by whoever runs frames, at the end of every one
+void profile_frame(profile_t *p)
+{
+    ++p->frames;
+    p->key_wait_frames += p->state == PROFILE_KEY_WAIT;
+    p->dt_wait_frames += p->state == PROFILE_DT_WAIT;
+}
+
+// run_switch() counting every instruction into profile_context
+uint32_t run_profiled(chip8_t *c, uint32_t budget)
+{
+    profile_t *p = profile_context;
+    uint32_t executed = 0;
+    while (executed < budget)
+    {
+        uint16_t pc = c->pc;
+        const chip8_decoded_t d = *fetch_decoded(c, pc);
+
+        dispatch(c);
+        ++executed;
+        profile_instruction(p, c, pc, d);
+
+        if (engine_stops_after(c, d.op, pc))
+            break;
+    }
+    return executed;
+}
+
+/** Profile reports **/
+
+// How many addresses the report lists
+const int profile_hot_addresses = 20;
+
+void appendf(std::string *out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    *out += line;
+}
+
+double profile_percent(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+// Indices of the nonzero counts, from the highest down
+std::vector<uint32_t> profile_hottest(const uint64_t *counts, uint32_t n)
+{
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < n; ++i)
+        if (counts[i])
+            order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return counts[a] > counts[b]; });
+    return order;
+}
+
+/* Human readable report on p, which was collected running c. Instructions are disassembled from memory as it
+   is now, so code the ROM wrote over shows what it ended up being */
+void format_profile(std::string *out, const profile_t *p, const chip8_t *c, const char *name)
+{
+    appendf(out, "Profile of '%s':\n================\n", name);
+    appendf(out, "%llu instructions in %llu frames\n", (unsigned long long)p->instructions,
+            (unsigned long long)p->frames);
+    appendf(out, "waiting for a key (Fx0A): %llu frames (%.1f%%), polled %llu times\n",
+            (unsigned long long)p->key_wait_frames, profile_percent(p->key_wait_frames, p->frames),
+            (unsigned long long)p->key_wait_polls);
+    appendf(out, "waiting for DT in a loop: %llu frames (%.1f%%), %llu instructions (%.1f%%)\n",
+            (unsigned long long)p->dt_wait_frames, profile_percent(p->dt_wait_frames, p->frames),
+            (unsigned long long)p->dt_wait_instructions, profile_percent(p->dt_wait_instructions, p->instructions));
+
+    appendf(out, "\nHottest addresses:\n");
+    std::vector<uint32_t> order = profile_hottest(p->pc_counts, memory_size);
+    for (size_t i = 0; i < order.size() && i < profile_hot_addresses; ++i)
+    {
+        char line[64];
+        uint16_t addr = order[i];
+        format_instruction(line, sizeof(line), { { { c->raw_memory[addr], c->raw_memory[(addr + 1) % memory_size] } } },
+                           addr);
+        appendf(out, "%12llu %5.1f%%\t%s\n", (unsigned long long)p->pc_counts[addr],
+                profile_percent(p->pc_counts[addr], p->instructions), line);
+    }
+    if (p->outside_memory)
+        appendf(out, "%12llu %5.1f%%\tpast the end of memory\n", (unsigned long long)p->outside_memory,
+                profile_percent(p->outside_memory, p->instructions));
+
+    appendf(out, "\nOpcode mix:\n");
+    for (uint32_t op : profile_hottest(p->op_counts, OP_COUNT))
+    {
+        std::string_view mnemonic = opcode_of((chip8_op_t)op)->mnemonic;
+        appendf(out, "%12llu %5.1f%%\t%.*s\n", (unsigned long long)p->op_counts[op],
+                profile_percent(p->op_counts[op], p->instructions), (int)mnemonic.size(), mnemonic.data());
+    }
+
+    appendf(out, "\nCalls:\n");
+    for (uint32_t addr : profile_hottest(p->call_counts, memory_size))
+        appendf(out, "%12llu\t%x\n", (unsigned long long)p->call_counts[addr], addr);
+    appendf(out, "================\nend of profile\n");
+}
+
+/* The call tree as folded stacks, one "root;caller;callee samples" line per function that ran anything, which
+   is what flamegraph.pl and friends take. root names the code outside any call */
+void format_folded_stacks(std::string *out, const profile_t *p, const char *root)
+{
+    // frames are separated by ';' and the count by a space, so the name cannot have either
+    std::string root_frame = root;
+    std::replace(root_frame.begin(), root_frame.end(), ';', '_');
+    std::replace(root_frame.begin(), root_frame.end(), ' ', '_');
+
+    std::vector<uint16_t> stack;
+    for (uint32_t n = 0; n < p->tree.size(); ++n)
+    {
+        if (!p->tree[n].samples)
+            continue;
+        stack.clear();
+        for (uint32_t f = n; f; f = p->tree[f].parent)
+            stack.push_back(p->tree[f].addr);
+
+        *out += root_frame;
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+            appendf(out, ";%x", *it);
+        appendf(out, " %llu\n", (unsigned long long)p->tree[n].samples);
+    }
+}
+
+/* Write a report to filename and the folded stacks next to it, at filename.folded.
+   Returns 0 on success, -1 with errno set otherwise */
+int save_profile(const char *filename, const std::string &report, const std::string &folded)
+{
+    std::string folded_filename = std::string(filename) + ".folded";
+    const char *names[] = { filename, folded_filename.c_str() };
+    const std::string *contents[] = { &report, &folded };
+    for (int i = 0; i < 2; ++i)
+    {
+        FILE *file_handle = fopen(names[i], "w");
+        if (!file_handle)
+            return -1;
+        size_t written = fwrite(contents[i]->data(), 1, contents[i]->size(), file_handle);
+        if (fclose(file_handle) || written != contents[i]->size())
+            return -1;
+    }
+    return 0;
+}
+
+#endif
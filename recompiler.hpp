@@ -0,0 +1,223 @@
+#ifndef CHIPPERINO_RECOMPILER_H
+#define CHIPPERINO_RECOMPILER_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <vector>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "rom.hpp"
+#include "disassembler.hpp"
+#include "analyzer.hpp"
+
+/* Ahead of time recompiler: turns a ROM into a C++ file with an engine made of its basic blocks, see aot.hpp
+   for how to build and run it. Every block becomes a label in one big function, and every instruction a call
+   to the same handler the interpreter uses, with operands the compiler can see, so that at -O2 those calls
+   fold into straight line code. Jumps to known blocks are gotos; anything else (RET, JP V0, addr, addresses
+   no block starts at, blocks the ROM wrote over) goes through a switch on pc or, failing that, dispatch() */
+
+// NOTE: must be kept in the same order as chip8_op_t
+const char *const op_handler_names[] = {
+    NULL,
+    "op_cls", "op_ret", "op_sys", "op_jp", "op_call",
+    "op_se_byte", "op_sne_byte", "op_se_reg", "op_ld_byte", "op_add_byte",
+    "op_ld_reg", "op_or", "op_and", "op_xor", "op_add_reg", "op_sub", "op_shr", "op_subn", "op_shl",
+    "op_sne_reg", "op_ld_i", "op_jp_v0", "op_rnd", "op_drw", "op_skp", "op_sknp",
+    "op_ld_vx_dt", "op_ld_vx_k", "op_ld_dt_vx", "op_ld_st_vx", "op_add_i_vx", "op_ld_f_vx",
+    "op_ld_b_vx", "op_ld_mem_vx", "op_ld_vx_mem",
+    NULL, // OP_ERROR does nothing
+};
+static_assert(sizeof(op_handler_names)/sizeof(op_handler_names[0]) == OP_COUNT);
+
+bool recompiler_writes_memory(uint8_t op)
+{
+    return op == OP_LD_B_VX || op == OP_LD_MEM_VX;
+}
+
+/* Where translated code may be entered: the start of every block, and right after the instructions that
+   leave it early (DRW and Fx0A return to the caller, writes to memory may have changed the code after them) */
+bool recompiler_is_entry(const basic_block_t *b, uint16_t addr, const chip8_t *c)
+{
+    if (addr == b->start)
+        return true;
+    uint8_t previous = find_opcode(instruction_word(instruction_at(c, addr - 2)))->op;
+    return previous == OP_DRW || previous == OP_LD_VX_K || recompiler_writes_memory(previous);
+}
+
+void recompile_goto(FILE *out, const rom_analysis_t *a, uint16_t target)
+{
+    if (find_block(a, target))
+        fprintf(out, "        goto L_%x;\n", target);
+    else
+        fprintf(out, "        continue;\n");
+}
+
+void recompile(const chip8_t *c, const rom_analysis_t *a, const char *name, FILE *out)
+{
+    fprintf(out, "// Translated by chipperino -c from '%s', do not edit\n", name);
+    fprintf(out, "#include \"aot.hpp\"\n\n");
+
+    fprintf(out, "const uint8_t aot_rom[] = {");
+    for (uint16_t i = 0; i < c->program_size; ++i)
+        fprintf(out, "%s0x%02X,", i % 16 ? " " : "\n    ", c->raw_memory[program_offset + i]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "const uint16_t aot_blocks[][2] = {\n");
+    for (const basic_block_t &b : a->blocks)
+        fprintf(out, "    { 0x%x, 0x%x },\n", b.start, b.last + 2);
+    if (a->blocks.empty())
+        fprintf(out, "    { 0x%x, 0x%x },\n", program_offset, program_offset);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "const aot_program_t aot = { \"");
+    for (const char *p = name; *p; ++p)
+    {
+        if (*p == '"' || *p == '\\')
+            fputc('\\', out);
+        fputc(isprint(*p) ? *p : '?', out);
+    }
+    fprintf(out, "\", aot_rom, sizeof(aot_rom), aot_blocks, %zu };\n\n", a->blocks.size());
+
+    fprintf(out, "uint32_t run_aot(chip8_t *c, uint32_t budget)\n{\n");
+    fprintf(out, "    uint32_t executed = 0;\n");
+    fprintf(out, "    for (;;)\n    {\n");
+    fprintf(out, "        if (c->code_epoch != aot_context.code_epoch)\n");
+    fprintf(out, "            aot_sync(c, &aot);\n");
+    fprintf(out, "        switch (c->pc)\n        {\n");
+    for (const basic_block_t &b : a->blocks)
+        for (uint16_t addr = b.start; addr <= b.last; addr += 2)
+            if (recompiler_is_entry(&b, addr, c))
+                fprintf(out, "        case 0x%x: goto L_%x;\n", addr, addr);
+    fprintf(out, "        default: break;\n        }\n\n");
+
+    fprintf(out, "    interpret:\n");
+    fprintf(out, "        // no translation for this address, or not enough budget left to run it\n");
+    fprintf(out, "        if (executed == budget)\n            return executed;\n");
+    fprintf(out, "        {\n");
+    fprintf(out, "            uint16_t pc = c->pc;\n");
+    fprintf(out, "            uint8_t op = fetch_decoded(c, pc)->op;\n");
+    fprintf(out, "            dispatch(c);\n");
+    fprintf(out, "            ++executed;\n");
+    fprintf(out, "            if (engine_stops_after(c, op, pc))\n");
+    fprintf(out, "                return executed;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        continue;\n");
+
+    for (size_t n = 0; n < a->blocks.size(); ++n)
+    {
+        const basic_block_t *b = &a->blocks[n];
+        fprintf(out, "\n");
+        for (uint16_t addr = b->start; addr <= b->last; addr += 2)
+        {
+            chip8_instruction_t i = instruction_at(c, addr);
+            chip8_decoded_t d = decode(i);
+            instruction_info_t info = disassemble(i);
+
+            if (recompiler_is_entry(b, addr, c))
+                fprintf(out, "    L_%x:\n        if (budget - executed < %u || aot_context.stale[%zu])\n            goto interpret;\n",
+                        addr, (b->last - addr) / 2 + 1, n);
+
+            fprintf(out, "        // %x: %.*s", addr, (int)info.mnemonic.size(), info.mnemonic.data());
+            for (int p = 0; p < info.nparams; ++p)
+                fprintf(out, "%s%X", p ? ", " : " ", info.params[p]);
+            fprintf(out, "\n        c->pc = 0x%x;\n", addr + 2);
+            if (op_handler_names[d.op])
+            {
+                char op_name[32];
+                snprintf(op_name, sizeof(op_name), "%s", op_handler_names[d.op]);
+                for (char *p = op_name; *p; ++p)
+                    *p = toupper(*p);
+                fprintf(out, "        %s(c, { 0x%x, %s, 0x%x, 0x%x, 0x%x });\n", op_handler_names[d.op], d.nnn, op_name,
+                        d.x, d.y, d.kk);
+            }
+            fprintf(out, "        ++executed;\n");
+
+            if (d.op == OP_DRW)
+                fprintf(out, "        return executed;\n");
+            if (d.op == OP_LD_VX_K)
+                fprintf(out, "        if (c->pc == 0x%x)\n            return executed;\n", addr);
+            // only jumps to themselves or back to the top of a DT wait loop can land in an idle loop
+            if (d.op == OP_JP && (d.nnn == addr || d.nnn + 4 == addr))
+                fprintf(out, "        if (idle_state(c))\n            return executed;\n");
+            if (recompiler_writes_memory(d.op))
+                fprintf(out, "        if (c->code_epoch != aot_context.code_epoch)\n            continue;\n");
+        }
+
+        // on to the next block
+        switch (b->last_op)
+        {
+        case OP_JP: case OP_SYS:
+            recompile_goto(out, a, decode(instruction_at(c, b->last)).nnn);
+            break;
+        case OP_CALL:
+            recompile_goto(out, a, b->callee);
+            break;
+        case OP_DRW:
+            break;
+        default:
+            if (b->nsuccessors == 1)
+            {
+                recompile_goto(out, a, b->successors[0]);
+                break;
+            }
+            // a skip goes either way, maybe out of the program, which only the switch on pc can tell
+            for (int s = 0; s < b->nsuccessors; ++s)
+                if (!b->leaves_program[s] && find_block(a, b->successors[s]))
+                    fprintf(out, "        if (c->pc == 0x%x)\n            goto L_%x;\n", b->successors[s], b->successors[s]);
+            fprintf(out, "        continue;\n");
+            break;
+        }
+    }
+    fprintf(out, "    }\n}\n\n");
+
+    fprintf(out, "int main(int argc, char *argv[])\n{\n");
+    fprintf(out, "    return aot_main(argc, argv, &aot, run_aot);\n}\n");
+}
+
+/* Translate the ROM in filename into a C++ file at output, or stdout if output is NULL.
+   Returns 0 on success, 1 otherwise */
+int recompile(char *filename, const char *output)
+{
+    chip8_t *c = new chip8_t();
+    if (load_rom(c, filename) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        delete c;
+        return 1;
+    }
+    rom_analysis_t *a = new rom_analysis_t();
+    analyze(c, a);
+
+    int status = 0;
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", output, strerror(errno));
+        status = 1;
+    }
+    else
+    {
+        // save states of the translated ROM go next to wherever it is run from, not where the ROM was
+        const char *name = strrchr(filename, '/');
+        recompile(c, a, name ? name + 1 : filename, out);
+        if (output && fclose(out))
+        {
+            fprintf(stderr, "Could not write '%s': %s\n", output, strerror(errno));
+            status = 1;
+        }
+        else if (a->unresolved.size())
+        {
+            fprintf(stderr, "%zu JP V0, addr instructions could not be followed, code only they reach is interpreted\n",
+                    a->unresolved.size());
+        }
+    }
+
+    delete a;
+    delete c;
+    return status;
+}
+
+#endif
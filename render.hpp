@@ -0,0 +1,113 @@
+#ifndef CHIPPERINO_RENDER_H
+#define CHIPPERINO_RENDER_H
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "architecture.hpp"
+#include "screen.hpp"
+
+/* Presentation runs on its own thread so a slow terminal never stalls the emulated CPU. The two threads share
+   a triple buffer: the CPU fills its own back buffer and swaps it with the spare one in a single atomic
+   exchange, the renderer swaps the spare one with its front buffer whenever it wants the newest frame.
+   Neither side ever waits for the other, and a frame the renderer did not get to in time is just replaced */
+
+// How often the render thread looks for a new frame, twice per 60 Hz frame
+auto render_polling_period = std::chrono::duration<double, std::milli>(1000/120.0);
+
+struct frame_t {
+    uint64_t rows[chip8_display_height];
+};
+
+struct frame_buffer_t {
+    frame_t frames[3];
+    // index of the spare frame, with frame_fresh set when the CPU published it and the renderer has not taken it
+    std::atomic<uint8_t> spare{2};
+    uint8_t back = 0;  // only touched by the CPU thread
+    uint8_t front = 1; // only touched by the render thread
+};
+
+const uint8_t frame_fresh = 0x4;
+const uint8_t frame_index = 0x3;
+
+// CPU side: hand over a copy of the display, replacing whatever frame the renderer did not take yet
+void publish_frame(frame_buffer_t *fb, const uint64_t *rows)
+{
+    memcpy(fb->frames[fb->back].rows, rows, sizeof(frame_t::rows));
+    // release so the renderer sees the rows we just wrote, acquire so we see it is done with what it gives back
+    fb->back = fb->spare.exchange(fb->back | frame_fresh, std::memory_order_acq_rel) & frame_index;
+}
+
+// Render side: the newest published frame, or NULL if nothing was published since we last looked
+const frame_t *take_frame(frame_buffer_t *fb)
+{
+    if (!(fb->spare.load(std::memory_order_relaxed) & frame_fresh))
+        return NULL;
+    fb->front = fb->spare.exchange(fb->front, std::memory_order_acq_rel) & frame_index;
+    return &fb->frames[fb->front];
+}
+
+const size_t status_size = 128;
+
+struct renderer_t {
+    frame_buffer_t frames;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    // one line of text under the display. Updates are rare, so a lock is fine here, it is never held while writing
+    std::mutex status_lock;
+    char status[status_size];
+    bool status_fresh = false;
+};
+
+// Show text on the status line, it is copied so the caller can reuse its buffer
+void publish_status(renderer_t *r, const char *text)
+{
+    std::lock_guard<std::mutex> lock(r->status_lock);
+    snprintf(r->status, status_size, "%s", text);
+    r->status_fresh = true;
+}
+
+void render_loop(renderer_t *r)
+{
+    while (r->running.load(std::memory_order_relaxed))
+    {
+        if (const frame_t *f = take_frame(&r->frames))
+            present_frame(f->rows);
+
+        char status[status_size];
+        bool fresh = false;
+        {
+            std::lock_guard<std::mutex> lock(r->status_lock);
+            if (r->status_fresh)
+            {
+                memcpy(status, r->status, status_size);
+                r->status_fresh = false;
+                fresh = true;
+            }
+        }
+        if (fresh)
+            present_status(status);
+        std::this_thread::sleep_for(render_polling_period);
+    }
+}
+
+// Draws the border and starts presenting whatever gets published to r->frames
+void start_renderer(renderer_t *r)
+{
+    print_border();
+    r->running = true;
+    r->thread = std::thread(render_loop, r);
+}
+
+// Stops the render thread once it is done with the frame it is presenting, if any
+void stop_renderer(renderer_t *r)
+{
+    r->running = false;
+    if (r->thread.joinable())
+        r->thread.join();
+}
+
+#endif
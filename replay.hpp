@@ -0,0 +1,189 @@
+#ifndef CHIPPERINO_REPLAY_H
+#define CHIPPERINO_REPLAY_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <chrono>
+#include <vector>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "rom.hpp"
+#include "scheduler.hpp"
+#include "savestate.hpp"
+#include "batch.hpp"
+
+/* Input recordings: the keys a ROM saw at the start of every frame, stored only on the frames where they
+   change, and the keys pressed partway through frames, stored with where in the frame they went down. The
+   machine's RNG starts from a fixed seed and run_frame() does not look at the host's clock, so playing the keys
+   back on the same ROM with the same instructions per frame repeats the run exactly.
+
+   Version 1 files have no presses, version 2 adds a u32 count of them after the entries, then the presses */
+
+const char recording_magic[4] = { 'C', 'H', '8', 'I' };
+const uint16_t recording_version = 2;
+// magic, version, instructions per frame, frames, ROM hash, entry count
+const size_t recording_header_size = 4 + 2 + 4 + 4 + 8 + 4;
+const size_t recording_entry_size = 4 + 2;
+const size_t recording_press_size = 4 + 4 + 2;
+
+struct input_log_entry_t {
+    uint32_t frame;
+    uint16_t keys;
+};
+
+struct input_log_press_t {
+    uint32_t frame;
+    key_press_t press;
+};
+
+struct input_recording_t {
+    uint32_t instructions_per_frame;
+    uint32_t frames = 0;
+    uint64_t rom_hash = 0;
+    std::vector<input_log_entry_t> entries;
+    std::vector<input_log_press_t> presses;
+};
+
+void start_recording(input_recording_t *r, const chip8_t *c, uint32_t instructions_per_frame)
+{
+    r->instructions_per_frame = instructions_per_frame;
+    r->frames = 0;
+    r->rom_hash = rom_hash(c);
+    r->entries.clear();
+    r->presses.clear();
+}
+
+// Log the keys the machine starts the next frame with, and the ones pressed during it as given to run_frame()
+void record_input(input_recording_t *r, uint16_t keys, const key_press_t *presses = NULL, size_t npresses = 0)
+{
+    if (r->entries.empty() || r->entries.back().keys != keys)
+        r->entries.push_back({ r->frames, keys });
+    for (size_t i = 0; i < npresses; ++i)
+        r->presses.push_back({ r->frames, presses[i] });
+    ++r->frames;
+}
+
+// Returns 0 on success, -1 with errno set otherwise
+int save_recording(const input_recording_t *r, const char *filename)
+{
+    std::vector<uint8_t> buffer(recording_header_size + r->entries.size() * recording_entry_size + 4 +
+                                r->presses.size() * recording_press_size);
+    uint8_t *p = buffer.data();
+    memcpy(p, recording_magic, sizeof(recording_magic));
+    p += sizeof(recording_magic);
+    p = put_u16(p, recording_version);
+    p = put_u32(p, r->instructions_per_frame);
+    p = put_u32(p, r->frames);
+    p = put_u64(p, r->rom_hash);
+    p = put_u32(p, r->entries.size());
+    for (const input_log_entry_t &e : r->entries)
+    {
+        p = put_u32(p, e.frame);
+        p = put_u16(p, e.keys);
+    }
+    p = put_u32(p, r->presses.size());
+    for (const input_log_press_t &e : r->presses)
+    {
+        p = put_u32(p, e.frame);
+        p = put_u32(p, e.press.position);
+        p = put_u16(p, e.press.keys);
+    }
+
+    FILE *file_handle = fopen(filename, "wb");
+    if (!file_handle)
+        return -1;
+    size_t written = fwrite(buffer.data(), 1, buffer.size(), file_handle);
+    if (fclose(file_handle) || written != buffer.size())
+        return -1;
+    return 0;
+}
+
+// Returns 0 on success, -1 with errno set otherwise (EINVAL if the file is not a recording we can read)
+int load_recording(input_recording_t *r, const char *filename)
+{
+    FILE *file_handle = fopen(filename, "rb");
+    if (!file_handle)
+        return -1;
+    std::vector<uint8_t> buffer;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file_handle)))
+        buffer.insert(buffer.end(), chunk, chunk + n);
+    fclose(file_handle);
+
+    uint16_t version;
+    uint32_t count, npresses = 0;
+    size_t size;
+    const uint8_t *p = buffer.data();
+    if (buffer.size() < recording_header_size || memcmp(p, recording_magic, sizeof(recording_magic)))
+        goto invalid;
+    p = get_u16(p + sizeof(recording_magic), &version);
+    if (version != 1 && version != recording_version)
+        goto invalid;
+    p = get_u32(p, &r->instructions_per_frame);
+    p = get_u32(p, &r->frames);
+    p = get_u64(p, &r->rom_hash);
+    p = get_u32(p, &count);
+    size = recording_header_size + (size_t)count * recording_entry_size;
+    if (version > 1)
+    {
+        if (buffer.size() < size + 4)
+            goto invalid;
+        get_u32(buffer.data() + size, &npresses);
+        size += 4 + (size_t)npresses * recording_press_size;
+    }
+    if (buffer.size() != size)
+        goto invalid;
+
+    r->entries.resize(count);
+    for (input_log_entry_t &e : r->entries)
+    {
+        p = get_u32(p, &e.frame);
+        p = get_u16(p, &e.keys);
+    }
+    if (version > 1)
+        p += 4;
+    r->presses.resize(npresses);
+    for (input_log_press_t &e : r->presses)
+    {
+        p = get_u32(p, &e.frame);
+        p = get_u32(p, &e.press.position);
+        p = get_u16(p, &e.press.keys);
+    }
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+// Play a recording back on c as fast as the engine goes, with no terminal, filling result like a batch run
+void replay(chip8_t *c, engine_f *engine, const input_recording_t *r, batch_result_t *result)
+{
+    size_t next = 0, next_press = 0;
+    std::vector<key_press_t> presses;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t frame = 0; frame < r->frames && c->pc < program_offset + c->program_size; ++frame)
+    {
+        // keys are set at the start of every frame, just like execute() does, to what they last changed to
+        while (next < r->entries.size() && r->entries[next].frame <= frame)
+            ++next;
+        c->input.keys = next ? r->entries[next - 1].keys : 0;
+        presses.clear();
+        for (; next_press < r->presses.size() && r->presses[next_press].frame <= frame; ++next_press)
+            if (r->presses[next_press].frame == frame)
+                presses.push_back(r->presses[next_press].press);
+
+        result->cycles += run_frame(c, engine, r->instructions_per_frame, presses.data(), presses.size());
+        ++result->frames;
+    }
+
+    result->wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    result->loaded = true;
+    fill_batch_result(c, result);
+}
+
+#endif
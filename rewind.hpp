@@ -0,0 +1,215 @@
+#ifndef CHIPPERINO_REWIND_H
+#define CHIPPERINO_REWIND_H
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+#include "architecture.hpp"
+#include "savestate.hpp"
+
+/* Rewind history: one snapshot per frame, kept in a fixed size ring of bytes. Every rewind_keyframe_interval
+   frames a keyframe is stored, the frames after it are stored as their XOR against that keyframe. From frame
+   to frame almost nothing in memory or the display changes, so those deltas are mostly zeros and shrink to a
+   few bytes each once run-length encoded. When the ring is full the oldest keyframe goes, along with the
+   deltas that depend on it */
+
+const uint32_t rewind_keyframe_interval = 60;
+// 16 MB hold several minutes of most ROMs
+const size_t rewind_default_budget = 16 << 20;
+
+/* Encoded snapshots are a list of (u16 skip, u16 length, length bytes) runs XORed over a base, where skip is
+   the number of bytes left as they are. Runs are only split on this many unchanged bytes, a shorter gap costs
+   less to copy than to start a new run over */
+const size_t rle_min_gap = 4;
+static_assert(chip8_state_size <= 0xFFFF);
+// every run but the last covers at least rle_min_gap + 1 bytes for its 4 B of header
+const size_t rle_max_size = chip8_state_size + 4 * (chip8_state_size / (rle_min_gap + 1) + 1);
+
+// XOR state against base and run-length encode the result into out. Returns the encoded size
+size_t rle_xor_encode(const uint8_t *state, const uint8_t *base, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+    while (i < chip8_state_size)
+    {
+        // skip what did not change, 8 B at a time while we can
+        size_t start = i;
+        while (i + 8 <= chip8_state_size && !memcmp(&state[i], &base[i], 8))
+            i += 8;
+        while (i < chip8_state_size && state[i] == base[i])
+            ++i;
+        if (i == chip8_state_size)
+            break;
+
+        size_t skip = i - start;
+        size_t end = i, gap = 0;
+        for (; i < chip8_state_size && gap < rle_min_gap; ++i)
+        {
+            if (state[i] != base[i])
+            {
+                end = i + 1;
+                gap = 0;
+            }
+            else
+            {
+                ++gap;
+            }
+        }
+        i = end;
+
+        p[0] = skip;
+        p[1] = skip >> 8;
+        p[2] = (end - start - skip);
+        p[3] = (end - start - skip) >> 8;
+        p += 4;
+        for (size_t j = start + skip; j < end; ++j)
+            *p++ = state[j] ^ base[j];
+    }
+    return p - out;
+}
+
+// Rebuild into state what rle_xor_encode() got from base
+void rle_xor_decode(const uint8_t *in, size_t size, const uint8_t *base, uint8_t *state)
+{
+    memcpy(state, base, chip8_state_size);
+    const uint8_t *end = in + size;
+    size_t i = 0;
+    while (in < end)
+    {
+        size_t skip = in[0] | (in[1] << 8);
+        size_t length = in[2] | (in[3] << 8);
+        in += 4;
+        i += skip;
+        for (size_t j = 0; j < length; ++j)
+            state[i++] ^= *in++;
+    }
+}
+
+struct rewind_entry_t {
+    size_t offset; // into the ring
+    size_t size;
+    bool keyframe;
+};
+
+struct rewind_buffer_t {
+    std::vector<uint8_t> ring;
+    std::deque<rewind_entry_t> entries; // oldest first, always starts with a keyframe
+    size_t head = 0;                    // where the next entry goes
+    uint32_t since_keyframe = 0;        // deltas stored after the newest keyframe
+    chip8_snapshot_t keyframe = {};     // decoded newest keyframe, what deltas are taken against
+    chip8_snapshot_t zero = {};         // keyframes are stored as deltas against nothing
+    chip8_snapshot_t scratch;
+    uint8_t encoded[rle_max_size];
+};
+
+void init_rewind(rewind_buffer_t *r, size_t budget = rewind_default_budget)
+{
+    r->ring.assign(budget, 0);
+    r->entries.clear();
+    r->head = 0;
+    r->since_keyframe = 0;
+}
+
+// Drop the oldest keyframe and every delta taken against it
+void drop_oldest_group(rewind_buffer_t *r)
+{
+    r->entries.pop_front();
+    while (!r->entries.empty() && !r->entries.front().keyframe)
+        r->entries.pop_front();
+}
+
+// Find size contiguous bytes in the ring, dropping old history to make room. Returns false if it never fits
+bool make_room(rewind_buffer_t *r, size_t size)
+{
+    if (size > r->ring.size())
+        return false;
+
+    if (r->head + size > r->ring.size())
+    {
+        // wrapping around: whatever is still past head is the oldest history, which we are about to lap
+        while (!r->entries.empty() && r->entries.front().offset >= r->head)
+            drop_oldest_group(r);
+        r->head = 0;
+    }
+    while (!r->entries.empty() && r->entries.front().offset >= r->head &&
+           r->entries.front().offset < r->head + size)
+        drop_oldest_group(r);
+    return true;
+}
+
+// Record the state c is in at the end of a frame
+void rewind_push(rewind_buffer_t *r, const chip8_t *c)
+{
+    take_snapshot(c, &r->scratch);
+
+    bool keyframe = r->entries.empty() || r->since_keyframe + 1 >= rewind_keyframe_interval;
+    for (;;)
+    {
+        const chip8_snapshot_t *base = keyframe ? &r->zero : &r->keyframe;
+        size_t size = rle_xor_encode(r->scratch.bytes, base->bytes, r->encoded);
+        if (!make_room(r, size))
+            return;
+        // making room may take the keyframe this delta depends on with it, then it has to be a keyframe itself
+        if (!keyframe && r->entries.empty())
+        {
+            keyframe = true;
+            continue;
+        }
+
+        memcpy(&r->ring[r->head], r->encoded, size);
+        r->entries.push_back({ r->head, size, keyframe });
+        r->head += size;
+        break;
+    }
+
+    if (keyframe)
+    {
+        r->keyframe = r->scratch;
+        r->since_keyframe = 0;
+    }
+    else
+    {
+        ++r->since_keyframe;
+    }
+}
+
+// Number of frames we can still go back
+size_t rewind_frames(rewind_buffer_t *r)
+{
+    return r->entries.empty() ? 0 : r->entries.size() - 1;
+}
+
+/* Put c back to how it was one frame before the newest recorded one, which is forgotten. Returns false if
+   there is nothing older to go back to */
+bool rewind_step(rewind_buffer_t *r, chip8_t *c)
+{
+    if (r->entries.size() < 2)
+        return false;
+
+    rewind_entry_t newest = r->entries.back();
+    r->entries.pop_back();
+    r->head = newest.offset;
+
+    if (newest.keyframe)
+    {
+        // back into the previous group, whose keyframe we have to decode again
+        size_t k = r->entries.size() - 1;
+        while (!r->entries[k].keyframe)
+            --k;
+        rewind_entry_t *e = &r->entries[k];
+        rle_xor_decode(&r->ring[e->offset], e->size, r->zero.bytes, r->keyframe.bytes);
+        r->since_keyframe = r->entries.size() - 1 - k;
+    }
+    else
+    {
+        --r->since_keyframe;
+    }
+
+    rewind_entry_t *e = &r->entries.back();
+    rle_xor_decode(&r->ring[e->offset], e->size, e->keyframe ? r->zero.bytes : r->keyframe.bytes, r->scratch.bytes);
+    restore_snapshot(c, &r->scratch);
+    return true;
+}
+
+#endif
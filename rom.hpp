@@ -0,0 +1,62 @@
+#ifndef CHIPPERINO_ROM_H
+#define CHIPPERINO_ROM_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "architecture.hpp"
+#include "utils.hpp"
+
+// Everything from the program offset to the end of memory
+const size_t max_rom_size = memory_size - program_offset;
+
+/* Copy a ROM image into the program region of c and record its size. Returns false, leaving c untouched, if
+   it does not fit */
+bool load_program(chip8_t *c, const uint8_t *program, size_t size)
+{
+    if (size > max_rom_size)
+        return false;
+    memcpy(&c->raw_memory[program_offset], program, size);
+    c->program_size = size;
+    return true;
+}
+
+/* Load the ROM in filename into c. Returns the number of bytes loaded, or -1 with errno set if the file could
+   not be read (EFBIG if it does not fit in memory) */
+int load_rom(chip8_t *c, const char *filename)
+{
+    mapped_file_t f;
+    if (map_file(&f, filename))
+        return -1;
+
+    bool fits = load_program(c, f.data, f.size);
+    size_t size = f.size;
+    unmap_file(&f);
+    if (!fits)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    return (int)size;
+}
+
+// FNV-1a, what ROMs are identified by in recordings and packs
+uint64_t hash_bytes(const uint8_t *p, size_t n)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Hash of the program loaded in c
+uint64_t rom_hash(const chip8_t *c)
+{
+    return hash_bytes(&c->raw_memory[program_offset], c->program_size);
+}
+
+#endif
@@ -3,187 +3,433 @@
 #include "screen.hpp"
 #include "keybindings.hpp"
 #include "dispatch.hpp"
-#include <chrono>
+#include "threaded.hpp"
+#include "jit.hpp"
+#include "rom.hpp"
+#include "render.hpp"
+#include "scheduler.hpp"
+#include "savestate.hpp"
+#include "rewind.hpp"
+#include "replay.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "input.hpp"
+#include <string>
 #include <ctype.h>
 
-typedef std::chrono::high_resolution_clock Clock;
-// The time we wait before peeking into player input
-auto input_polling_period = std::chrono::duration<double, std::milli>(1000/60.0);
-// The Chip8 DT register has a 60 Hz update freq
-auto dt_decrement_period = std::chrono::duration<double, std::milli>(1000/60.0);
+struct runtime_config_t {
+    engine_f *engine = run_switch;
+    uint32_t instructions_per_frame = default_instructions_per_frame;
+    // spin this long at the end of every frame instead of trusting the kernel to wake us up on time
+    int64_t spin_ns = 0;
+    // start in turbo mode
+    bool turbo = false;
+    // bytes kept for rewind history, 0 turns it off
+    size_t rewind_budget = rewind_default_budget;
+    // where to save the keys played, if anywhere
+    const char *record_filename = NULL;
+    // where to save a profile of the run, if anywhere. Profiling runs run_profiled() instead of the engine
+    const char *profile_filename = NULL;
+    // where to save a trace of every instruction run, if anywhere. Tracing runs run_traced() instead of the engine
+    const char *trace_filename = NULL;
+};
 
-void execute(char *filename)
+// Throughput over a stretch of turbo mode
+struct turbo_stats_t {
+    int64_t start_ns = 0;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;    // emulated 1/60 s frames
+    uint64_t presented = 0; // frames handed to the renderer
+};
+
+void format_turbo_report(char *out, size_t n, turbo_stats_t *t)
 {
-    // ensure we are in an interactive enviroment
-    check_for_terminal();
-    
-    FILE *file_handle = fopen(filename, "rb");
-    chip8_instruction_t *p = &chip8.memory.as_words[program_offset/sizeof(chip8_instruction_t)];
-    chip8_instruction_t i;
+    double seconds = (monotonic_ns() - t->start_ns) / 1e9;
+    snprintf(out, n, "turbo: %.0f instructions/s, %.1f frames/s, %.1f presented/s over %.2f s",
+             t->instructions / seconds, t->frames / seconds, t->presented / seconds, seconds);
+}
 
-    // Read instructions one-by-one
-    while (p < ((chip8_instruction_t *) &chip8.memory + 4096) && fread(&i, sizeof(chip8_instruction_t), 1, file_handle))
+// Pick an engine by the name given in the command line, NULL if there is no such engine
+engine_f *engine_by_name(const char *name)
+{
+    if (!strcmp(name, "switch"))
+        return run_switch;
+    if (!strcmp(name, "threaded"))
+        return run_threaded;
+    if (!strcmp(name, "jit"))
+        return run_jit;
+    return NULL;
+}
+
+// Replay a recording made with execute() on the given ROM, headless, and print a batch style summary
+int replay_recording(char *filename, const char *recording_filename, engine_f *engine)
+{
+    input_recording_t recording;
+    if (load_recording(&recording, recording_filename))
     {
-        *p = i;            // Save written instruction to memory 
-        ++p;               // advance pointer
-        program_size += 2; // and count bytes read
+        fprintf(stderr, "Could not read recording '%s': %s\n", recording_filename, strerror(errno));
+        return 1;
     }
-    fclose(file_handle);
+
+    chip8_t *c = new chip8_t();
+    if (load_rom(c, filename) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        delete c;
+        return 1;
+    }
+    if (rom_hash(c) != recording.rom_hash)
+        fprintf(stderr, "Warning: '%s' was recorded on a different ROM\n", recording_filename);
+
+    batch_result_t result = {};
+    replay(c, engine, &recording, &result);
+    print_batch_result(filename, &result);
+    delete c;
+    return 0;
+}
+
+// Run the program already loaded in c on the terminal until it ends or the user quits. Takes ownership of c
+void execute(chip8_t *c, const char *name, runtime_config_t *config)
+{
+    // ensure we are in an interactive enviroment
+    check_for_terminal();
 
     // set terminal to raw mode so we can have a pretty display
     set_console_raw_mode(true);
+    // frames are presented on their own thread, so a slow terminal does not slow down the CPU
+    renderer_t renderer;
+    start_renderer(&renderer);
+    // and keys are read on theirs, as soon as they come in
+    input_reader_t *input = new input_reader_t();
+    start_input_reader(input);
 
     /* End of misc. preparations */
     
     /** vvv Proper runtime section vvv **/
 
-    auto input_timestamp = Clock::now();
-    auto dt_timestamp = Clock::now();
+    scheduler_t scheduler;
+    start_scheduler(&scheduler, config->instructions_per_frame, config->spin_ns);
     chip8_input_t last_input = {0};
     chip8_input_t curr_input = {0};
-    
-    // continue the VM until we are outside the program's memory region
-    while(chip8.pc < program_offset + program_size)
+    std::vector<key_press_t> presses;
+    frame_run_t frame;
+
+    /* In turbo mode there is no sleeping: DT still ticks every instructions_per_frame instructions, so the ROM
+       sees the same timing, only faster, and frames are presented at most at 60 Hz of real time */
+    bool turbo = config->turbo;
+    turbo_stats_t turbo_stats = { monotonic_ns() };
+    int64_t next_present_ns = 0;
+    char report[status_size];
+    std::string state_filename = std::string(name) + ".state";
+
+    // going back in time would make the recording useless, so rewinding and loading states are off while recording
+    input_recording_t *recording = NULL;
+    if (config->record_filename)
+    {
+        recording = new input_recording_t();
+        start_recording(recording, c, config->instructions_per_frame);
+    }
+
+    profile_t *profile = NULL;
+    engine_f *engine = config->engine;
+    if (config->profile_filename)
     {
+        profile = new profile_t();
+        start_profile(profile);
+        profile_context = profile;
+        engine = run_profiled;
+    }
 
-#ifdef __linux__
-        // Sleep for 2 usecs roughly translates into 500 MHz
-        usleep(2);
-#else
-        // Windows cannot sleep for <1ms, so we do a busywait
-        auto busywait_start = Clock::now();
-        while(1)
+    trace_ring_t *trace = NULL;
+    if (config->trace_filename)
+    {
+        trace = new trace_ring_t();
+        start_trace_writer();
+        if (start_trace(trace, config->trace_filename))
         {
-            auto time_slept = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - busywait_start);
-            if (time_slept.count() >= 2)
-              break;
+            fprintf(stderr, "Could not save the trace to '%s': %s\n", config->trace_filename, strerror(errno));
+            delete trace;
+            trace = NULL;
+            stop_trace_writer();
         }
-#endif
-
-        // update the timers for this clock cycle
-        auto now = Clock::now();
-        auto input_dt = std::chrono::duration_cast<std::chrono::milliseconds>(now - input_timestamp);
-        auto dt_dt = std::chrono::duration_cast<std::chrono::milliseconds>(now - dt_timestamp);
-       
-        // decrement DT register every 1/60 s
-        if (dt_dt > dt_decrement_period)
+        else
         {
-            dt_timestamp = now;
-            if (chip8.dt > 0)
-                --chip8.dt;
+            trace_context = trace;
+            engine = run_traced;
         }
-        
-        // Only read input if enough time has passed
-        if (input_dt > input_polling_period)
+    }
+
+    rewind_buffer_t *rewind = NULL;
+    if (config->rewind_budget && !recording)
+    {
+        rewind = new rewind_buffer_t();
+        init_rewind(rewind, config->rewind_budget);
+    }
+    
+    // continue the VM until we are outside the program's memory region
+    while(c->pc < program_offset + c->program_size)
+    {
+        // keys go down where the frame is when they come in and stay down until its end, when timers tick
+        /* Reset input */
+        last_input = curr_input;
+        curr_input = {};
+        presses.clear();
+        c->input.keys = 0;
+        start_frame(&frame, c, scheduler.instructions_per_frame);
+        bool rewinding = false;
+
+        while (!rewinding)
         {
+            // catch up with the wall clock first, so the keys that woke us up go in where the frame is by now
+            if (!turbo)
+                run_frame_until(c, engine, &frame, frame_position(&scheduler, frame.length, monotonic_ns()));
+            // keys still in the queue go to the next frame
+            if (frame_done(&frame, c))
+                break;
 
-            /* Reset input */
-            last_input = curr_input;
-            curr_input = {};
-            
-            input_timestamp = now;
             /* Input handling */
-            char c = 0;
-
-            while (read_raw_input(&c, 1)) // consume all pending keypresses
+            key_event_t event;
+            while (pop_key_event(&input->queue, &event)) // consume all pending keypresses
             {
-                switch (toupper(c))
+                chip8_input_t pressed = {0};
+                switch (toupper(event.key))
                 {
                 case CHIP8_KEY_END:
                     goto exit_simulation;
                     break;
-                    
+
+                case CHIP8_KEY_TURBO:
+                    turbo = !turbo;
+                    if (turbo)
+                    {
+                        turbo_stats = { monotonic_ns() };
+                        publish_status(&renderer, "turbo");
+                    }
+                    else
+                    {
+                        format_turbo_report(report, sizeof(report), &turbo_stats);
+                        publish_status(&renderer, report);
+                        // back to real time from now on, instead of sleeping until the frames we skipped catch up
+                        start_scheduler(&scheduler, config->instructions_per_frame, config->spin_ns);
+                    }
+                    break;
+
+                case CHIP8_KEY_REWIND:
+                    rewinding = rewind != NULL;
+                    break;
+
+                case CHIP8_KEY_SAVE_STATE:
+                    if (save_state_file(c, state_filename.c_str()))
+                        snprintf(report, sizeof(report), "Could not save '%s': %s", state_filename.c_str(), strerror(errno));
+                    else
+                        snprintf(report, sizeof(report), "Saved '%s'", state_filename.c_str());
+                    publish_status(&renderer, report);
+                    break;
+
+                case CHIP8_KEY_LOAD_STATE:
+                    if (recording)
+                        snprintf(report, sizeof(report), "Cannot load states while recording");
+                    else if (load_state_file(c, state_filename.c_str()))
+                        snprintf(report, sizeof(report), "Could not load '%s': %s", state_filename.c_str(), strerror(errno));
+                    else
+                    {
+                        snprintf(report, sizeof(report), "Loaded '%s'", state_filename.c_str());
+                        // its clock can be anywhere in a frame
+                        start_frame(&frame, c, scheduler.instructions_per_frame);
+                    }
+                    publish_status(&renderer, report);
+                    break;
+                
                 case CHIP8_KEY_0:
-                    curr_input.key_0 = true;
+                    pressed.key_0 = true;
                     break;
-                    
+                
                 case CHIP8_KEY_1:
-                    curr_input.key_1 = true;
+                    pressed.key_1 = true;
                     break;
 
                 case CHIP8_KEY_2:
-                    curr_input.key_2 = true;
+                    pressed.key_2 = true;
                     break;
 
                 case CHIP8_KEY_3:
-                    curr_input.key_3 = true;
+                    pressed.key_3 = true;
                     break;
 
                 case CHIP8_KEY_4:
-                    curr_input.key_4 = true;
+                    pressed.key_4 = true;
                     break;
 
                 case CHIP8_KEY_5:
-                    curr_input.key_5 = true;
+                    pressed.key_5 = true;
                     break;
 
                 case CHIP8_KEY_6:
-                    curr_input.key_6 = true;
+                    pressed.key_6 = true;
                     break;
 
                 case CHIP8_KEY_7:
-                    curr_input.key_7 = true;
+                    pressed.key_7 = true;
                     break;
 
                 case CHIP8_KEY_8:
-                    curr_input.key_8 = true;
+                    pressed.key_8 = true;
                     break;
 
                 case CHIP8_KEY_9:
-                    curr_input.key_9 = true;
+                    pressed.key_9 = true;
                     break;
 
                 case CHIP8_KEY_A:
-                    curr_input.key_a = true;
+                    pressed.key_a = true;
                     break;
 
                 case CHIP8_KEY_B:
-                    curr_input.key_b = true;
+                    pressed.key_b = true;
                     break;
 
                 case CHIP8_KEY_C:
-                    curr_input.key_c = true;
+                    pressed.key_c = true;
                     break;
 
                 case CHIP8_KEY_D:
-                    curr_input.key_d = true;
+                    pressed.key_d = true;
                     break;
 
                 case CHIP8_KEY_E:
-                    curr_input.key_e = true;
+                    pressed.key_e = true;
                     break;
 
                 case CHIP8_KEY_F:
-                    curr_input.key_f = true;
+                    pressed.key_f = true;
                     break;
 
                 default:
                     break;
                 }
+
+                /* Most CHIP8 ROMs do not deal well with repeated input from held keys. For now were just ignoring held
+                   keys, and a key only goes down once a frame */
+                uint16_t keys = pressed.keys & ~(last_input.keys | curr_input.keys);
+                curr_input.keys |= pressed.keys;
+                if (keys)
+                {
+                    c->input.keys |= keys;
+                    presses.push_back({ frame.position, keys });
+                }
+            }
+
+            if (turbo)
+                run_frame_until(c, engine, &frame, frame.length);
+            else if (!rewinding)
+                wait_for_deadline_or_key(&scheduler, input);
+        }
+
+        if (rewinding)
+        {
+            // instead of finishing the frame, go back to the one before
+            if (!rewind_step(rewind, c))
+                publish_status(&renderer, "Nothing left to rewind");
+        }
+        else
+        {
+            end_frame(c, &frame);
+            // keys only go down through presses, the frame started with none
+            if (recording)
+                record_input(recording, 0, presses.data(), presses.size());
+            if (rewind)
+                rewind_push(rewind, c);
+        }
+        if (!turbo)
+            next_frame_deadline(&scheduler);
+
+        /* A halted machine will not change until we load a state or rewind, so instead of waking up every frame
+           to find it as it was, present what it left on screen and sleep until there are keys to look at */
+        if (idle_state(c) == IDLE_HALTED && c->pc < program_offset + c->program_size)
+        {
+            if (c->display_update)
+            {
+                publish_frame(&renderer.frames, c->display);
+                c->display_update = false;
+            }
+            wait_for_key_event(input);
+            start_scheduler(&scheduler, config->instructions_per_frame, config->spin_ns);
+            continue;
+        }
+        if (turbo)
+        {
+            turbo_stats.instructions += frame.executed;
+            ++turbo_stats.frames;
+
+            int64_t now = monotonic_ns();
+            if (c->display_update && now >= next_present_ns)
+            {
+                publish_frame(&renderer.frames, c->display);
+                c->display_update = false;
+                next_present_ns = now + frame_period_ns;
+                ++turbo_stats.presented;
             }
-            /* Most CHIP8 ROMs do not deal well with repeated input from held keys. For now were just ignoring held keys */
-            chip8.input.keys = curr_input.keys & ~(last_input.keys);
+            /* as fast as possible is still not worth a core spent polling for keys: the frame ended on an Fx0A with
+               no key to take, nothing will run until one shows up or the timers tick */
+            if (idle_state(c) == IDLE_KEY_WAIT)
+                wait_for_key_event(input, frame_period_ns);
         }
-        
-
-        // execute next instruction
-        
-        dispatch();
-        
-        
-        
-        if (display_update)
+        else
         {
-            clear_screen();
-            draw_display();
-            display_update = false;
-            fflush(stdout);        
+            if (c->display_update)
+            {
+                publish_frame(&renderer.frames, c->display);
+                c->display_update = false;
+            }
         }
     }
 
 exit_simulation:
+    stop_renderer(&renderer);
+    stop_input_reader(input);
+    delete input;
     // restore console normal config
     set_console_raw_mode(false);
     // clearing screen on normal mode should draw the console prompt
     clear_screen();
+    if (turbo)
+    {
+        format_turbo_report(report, sizeof(report), &turbo_stats);
+        printf("%s\n", report);
+    }
+    if (recording && save_recording(recording, config->record_filename))
+        fprintf(stderr, "Could not save the recording to '%s': %s\n", config->record_filename, strerror(errno));
+    if (profile)
+    {
+        std::string report, folded;
+        format_profile(&report, profile, c, name);
+        format_folded_stacks(&folded, profile, name);
+        if (save_profile(config->profile_filename, report, folded))
+            fprintf(stderr, "Could not save the profile to '%s': %s\n", config->profile_filename, strerror(errno));
+        profile_context = NULL;
+    }
+    delete profile;
+    if (trace)
+    {
+        if (stop_trace(trace))
+            fprintf(stderr, "Could not save the trace to '%s': %s\n", config->trace_filename, strerror(errno));
+        stop_trace_writer();
+        trace_context = NULL;
+    }
+    delete trace;
+    delete recording;
+    delete rewind;
+    delete c;
+}
+
+void execute(char *filename, runtime_config_t *config)
+{
+    chip8_t *c = new chip8_t();
+    if (load_rom(c, filename) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        delete c;
+        return;
+    }
+    execute(c, filename, config);
 }
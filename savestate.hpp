@@ -0,0 +1,198 @@
+#ifndef CHIPPERINO_SAVESTATE_H
+#define CHIPPERINO_SAVESTATE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+
+/** In-memory snapshots **/
+
+/* Everything in chip8_t up to the decode cache is the machine's state, and it is plain data laid out in one
+   block, so a snapshot is a single memcpy. The decode cache and the code epoch are derived from memory and are
+   left alone, restoring only drops the cached instructions whose bytes actually change */
+const size_t chip8_state_size = offsetof(chip8_t, decoded);
+
+struct chip8_snapshot_t {
+    uint8_t bytes[chip8_state_size];
+};
+
+void take_snapshot(const chip8_t *c, chip8_snapshot_t *s)
+{
+    memcpy(s->bytes, (const void *)c, chip8_state_size);
+}
+
+// Drop the decoded instructions that overlap bytes about to be replaced by memory, 8 B at a time
+void invalidate_changed_code(chip8_t *c, const uint8_t *memory)
+{
+    for (uint16_t addr = 0; addr < memory_size; addr += 8)
+        if (memcmp(&c->raw_memory[addr], &memory[addr], 8))
+            invalidate_decoded(c, addr, 8);
+}
+
+void restore_snapshot(chip8_t *c, const chip8_snapshot_t *s)
+{
+    // memory is the first thing in chip8_t, and a frame back usually changes no code at all
+    static_assert(offsetof(chip8_t, raw_memory) == 0);
+    invalidate_changed_code(c, s->bytes);
+
+    memcpy((void *)c, s->bytes, chip8_state_size);
+    // whatever is on screen now belongs to another point in time
+    c->display_update = true;
+}
+
+/** Save state files **/
+
+/* Versioned and independent of the host: every field is written out explicitly in little endian, so files
+   keep working across compilers, platforms and changes to chip8_t's layout. Bump the version whenever a field
+   is added, removed or changes meaning */
+const char save_state_magic[4] = { 'C', 'H', '8', 'S' };
+const uint16_t save_state_version = 2;
+
+const size_t save_state_size =
+    sizeof(save_state_magic) + 2 /* version */ +
+    memory_size + 16 * 2 /* stack */ + 16 /* regs */ + 2 + 2 /* I, pc */ + 3 /* sp, dt, st */ + 8 /* cycles */ +
+    chip8_display_height * 8 + 2 /* keys */ + 8 + 8 /* rng */ + 2 /* program_size */;
+
+uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = v >> (i * 8);
+    return p + 4;
+}
+
+uint8_t *put_u64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = v >> (i * 8);
+    return p + 8;
+}
+
+const uint8_t *get_u16(const uint8_t *p, uint16_t *v)
+{
+    *v = p[0] | (p[1] << 8);
+    return p + 2;
+}
+
+const uint8_t *get_u32(const uint8_t *p, uint32_t *v)
+{
+    *v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    return p + 4;
+}
+
+const uint8_t *get_u64(const uint8_t *p, uint64_t *v)
+{
+    *v = 0;
+    for (int i = 0; i < 8; ++i)
+        *v |= (uint64_t)p[i] << (i * 8);
+    return p + 8;
+}
+
+// Write c into out, which must hold save_state_size bytes
+void serialize_state(const chip8_t *c, uint8_t *out)
+{
+    uint8_t *p = out;
+    memcpy(p, save_state_magic, sizeof(save_state_magic));
+    p += sizeof(save_state_magic);
+    p = put_u16(p, save_state_version);
+
+    memcpy(p, c->raw_memory, memory_size);
+    p += memory_size;
+    for (int i = 0; i < 16; ++i)
+        p = put_u16(p, c->stack[i]);
+    memcpy(p, c->regs, 16);
+    p += 16;
+    p = put_u16(p, c->I);
+    p = put_u16(p, c->pc);
+    *p++ = c->sp;
+    *p++ = c->dt;
+    *p++ = c->st;
+    p = put_u64(p, c->cycles);
+    for (int i = 0; i < chip8_display_height; ++i)
+        p = put_u64(p, c->display[i]);
+    p = put_u16(p, c->input.keys);
+    p = put_u64(p, c->rng.state);
+    p = put_u64(p, c->rng.inc);
+    p = put_u16(p, c->program_size);
+}
+
+/* Load a state written by serialize_state() into c. Returns false, leaving c untouched, if the data is not a
+   save state or comes from a version we do not know */
+bool deserialize_state(chip8_t *c, const uint8_t *in, size_t size)
+{
+    uint16_t version;
+    if (size != save_state_size || memcmp(in, save_state_magic, sizeof(save_state_magic)))
+        return false;
+    const uint8_t *p = get_u16(in + sizeof(save_state_magic), &version);
+    if (version != save_state_version)
+        return false;
+
+    invalidate_changed_code(c, p);
+    memcpy(c->raw_memory, p, memory_size);
+    p += memory_size;
+
+    for (int i = 0; i < 16; ++i)
+        p = get_u16(p, &c->stack[i]);
+    memcpy(c->regs, p, 16);
+    p += 16;
+    p = get_u16(p, &c->I);
+    p = get_u16(p, &c->pc);
+    c->sp = *p++;
+    c->dt = *p++;
+    c->st = *p++;
+    p = get_u64(p, &c->cycles);
+    for (int i = 0; i < chip8_display_height; ++i)
+        p = get_u64(p, &c->display[i]);
+    p = get_u16(p, &c->input.keys);
+    p = get_u64(p, &c->rng.state);
+    p = get_u64(p, &c->rng.inc);
+    p = get_u16(p, &c->program_size);
+    c->display_update = true;
+    return true;
+}
+
+// Returns 0 on success, -1 with errno set otherwise
+int save_state_file(const chip8_t *c, const char *filename)
+{
+    uint8_t buffer[save_state_size];
+    serialize_state(c, buffer);
+
+    FILE *file_handle = fopen(filename, "wb");
+    if (!file_handle)
+        return -1;
+    size_t written = fwrite(buffer, 1, sizeof(buffer), file_handle);
+    if (fclose(file_handle) || written != sizeof(buffer))
+        return -1;
+    return 0;
+}
+
+// Returns 0 on success, -1 with errno set otherwise (EINVAL if the file is not a save state we can read)
+int load_state_file(chip8_t *c, const char *filename)
+{
+    uint8_t buffer[save_state_size + 1];
+
+    FILE *file_handle = fopen(filename, "rb");
+    if (!file_handle)
+        return -1;
+    // ask for one byte more than we expect, so longer files are caught too
+    size_t size = fread(buffer, 1, sizeof(buffer), file_handle);
+    fclose(file_handle);
+
+    if (!deserialize_state(c, buffer, size))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef CHIPPERINO_SCHEDULER_H
+#define CHIPPERINO_SCHEDULER_H
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+#include "profiler.hpp"
+
+#ifdef __linux__
+#include <time.h>
+#endif
+
+/* Frame scheduler: the CPU runs a fixed budget of instructions per 1/60 s frame. It sleeps once until the
+   absolute deadline of the frame and runs it then, unless a key comes in first: then it runs the frame up to
+   where the wall clock says it should be (see frame_position()), so the key goes in right there, and goes back
+   to sleep. Deadlines advance by exactly one frame, so oversleeping one frame is made up in the next one
+   instead of drifting */
+
+const int64_t frame_period_ns = 1000000000 / 60;
+// Instructions per 1/60 s frame, ~500 KHz
+const uint32_t default_instructions_per_frame = 8333;
+// If we fall this far behind (suspended, debugger...) we skip the missed frames instead of racing through them
+const int64_t max_frame_lag = 4;
+
+struct scheduler_t {
+    int64_t deadline_ns;           // when the current frame ends
+    int64_t spin_ns;               // how much of the wait for a deadline is spent spinning instead of sleeping
+    uint32_t instructions_per_frame;
+};
+
+// Monotonic time in ns, from an arbitrary origin
+int64_t monotonic_ns()
+{
+#ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void start_scheduler(scheduler_t *s, uint32_t instructions_per_frame, int64_t spin_ns = 0)
+{
+    s->instructions_per_frame = instructions_per_frame;
+    s->spin_ns = spin_ns;
+    s->deadline_ns = monotonic_ns() + frame_period_ns;
+}
+
+// Move on to the next frame's deadline, skipping the frames we are too late for
+void next_frame_deadline(scheduler_t *s)
+{
+    s->deadline_ns += frame_period_ns;
+    int64_t now = monotonic_ns();
+    if (now - s->deadline_ns > max_frame_lag * frame_period_ns)
+        s->deadline_ns = now + frame_period_ns;
+}
+
+// How far into a frame of length cycles the wall clock says we should be at now_ns
+uint32_t frame_position(const scheduler_t *s, uint32_t length, int64_t now_ns)
+{
+    int64_t elapsed = now_ns - (s->deadline_ns - frame_period_ns);
+    if (elapsed <= 0)
+        return 0;
+    if (elapsed >= frame_period_ns)
+        return length;
+    return (uint32_t)(elapsed * length / frame_period_ns);
+}
+
+// Keys that go down partway through a frame, once position instructions of it have gone by
+struct key_press_t {
+    uint32_t position;
+    uint16_t keys;
+};
+
+/* A frame: the cycles up to the machine's next 60 Hz timer tick, budget of them a frame, then the tick. It can be
+   run in one go, see run_frame(), or bit by bit with run_frame_until(), and it ends the same either way: what
+   happens only depends on the machine, its input and where in the frame that input goes in, never on how the
+   frame was split, which is what makes input recordings replayable */
+struct frame_run_t {
+    uint32_t budget;
+    // a whole frame, unless the clock was left partway through one (a state saved at another budget...)
+    uint32_t length;
+    uint32_t position; // how far into the frame we are, instructions executed and skipped alike
+    uint32_t executed;
+};
+
+void start_frame(frame_run_t *f, const chip8_t *c, uint32_t budget)
+{
+    f->budget = budget;
+    f->length = cycles_to_tick(c, budget);
+    f->position = 0;
+    f->executed = 0;
+}
+
+bool frame_done(const frame_run_t *f, const chip8_t *c)
+{
+    return f->position >= f->length || c->pc >= program_offset + c->program_size;
+}
+
+/* Run f up to until, or its end. A machine that is only waiting (see idle_state()) skips ahead instead of
+   spinning. Returns the number of instructions executed */
+uint32_t run_frame_until(chip8_t *c, engine_f *engine, frame_run_t *f, uint32_t until)
+{
+    until = std::min(until, f->length);
+    uint32_t executed = 0;
+    while (f->position < until && c->pc < program_offset + c->program_size)
+    {
+        uint32_t ran = until - f->position;
+        if (!idle_state(c))
+        {
+            ran = engine(c, ran);
+            executed += ran;
+        }
+        f->position += ran;
+        // the clock keeps up with every run, so the next one sees the cycle it starts at. The tick only comes with
+        // the last one, at length
+        advance_clock(c, ran, f->budget);
+    }
+    f->executed += executed;
+    return executed;
+}
+
+void end_frame(chip8_t *c, frame_run_t *f)
+{
+    if (profile_context)
+        profile_frame(profile_context);
+    // the rest of the frame, if the program left its memory region partway through
+    advance_clock(c, f->length - f->position, f->budget);
+    f->position = f->length;
+}
+
+/* Run a whole frame in one go. presses, sorted by position, are ORed into the machine's keys as the frame gets to
+   them. Returns the number of instructions executed */
+uint32_t run_frame(chip8_t *c, engine_f *engine, uint32_t budget, const key_press_t *presses = NULL,
+                   size_t npresses = 0)
+{
+    frame_run_t f;
+    start_frame(&f, c, budget);
+    size_t next = 0;
+    while (!frame_done(&f, c))
+    {
+        for (; next < npresses && presses[next].position <= f.position; ++next)
+            c->input.keys |= presses[next].keys;
+        run_frame_until(c, engine, &f, next < npresses ? presses[next].position : f.length);
+    }
+    end_frame(c, &f);
+    return f.executed;
+}
+
+#endif
@@ -2,6 +2,18 @@
 #define CHIPPERINO_SCREEN_H
 #include "utils.hpp"
 #include "architecture.hpp"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIPPERINO_GLYPHS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GLYPHS_AVX2
+#else
+#define GLYPHS_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 #define RESET_SCREEN "\033[2J"
 #define RESET_CURSOR "\033[H"
@@ -11,52 +23,246 @@
 
 #define DISPLAY_START "\033[2;2H"
 
-char screen_buffer[chip8_display_height+2][chip8_display_width+3];
-
-void print_border()
-{    
-    // top border
-    screen_buffer[0][0] = '/';
-    for (int i = 1; i <= chip8_display_width; ++i)
-      screen_buffer[0][i] = '-';
-    
-    screen_buffer[0][chip8_display_width+1] = '\\';
-    // middle
-    for (int i = 1; i <= chip8_display_height; ++i)
+#define PIXEL_ON '*'
+#define PIXEL_OFF ' '
+
+/** Glyph expansion **/
+
+/* Turning a packed row into its 64 glyphs, the innermost loop of building frames. Besides the plain loop there
+   are SSE2 and AVX2 versions doing 16 and 32 pixels a step: every byte of a vector gets the display byte its
+   pixel is in, keeps only that pixel's bit, and the comparison against the bit picks one glyph or the other.
+   expand_glyphs is the fastest one the CPU we are on runs, picked once at startup */
+
+typedef void expand_glyphs_f(char *out, uint64_t row);
+
+// Writes chip8_display_width glyphs to out, pixel 0 (the top bit) first
+void expand_glyphs_scalar(char *out, uint64_t row)
+{
+    for (int x = 0; x < chip8_display_width; ++x, row <<= 1)
+        out[x] = (row >> 63) ? PIXEL_ON : PIXEL_OFF;
+}
+
+#ifdef CHIPPERINO_GLYPHS_X86
+// Byte n set to the bit of pixel n % 8 in its display byte, the top one first
+const uint64_t glyph_bits = 0x0102040810204080ULL;
+// A byte spread over all 8 bytes of a word when multiplied by it
+const uint64_t glyph_spread = 0x0101010101010101ULL;
+
+void expand_glyphs_sse2(char *out, uint64_t row)
+{
+    const __m128i bits = _mm_set1_epi64x(glyph_bits);
+    const __m128i off = _mm_set1_epi8(PIXEL_OFF);
+    const __m128i flip = _mm_set1_epi8(PIXEL_ON ^ PIXEL_OFF);
+    for (int i = 0; i < chip8_display_width / 16; ++i, row <<= 16)
     {
-        printf("|%*s|" NEXT_LINE, chip8_display_width, "");
-        screen_buffer[i][0] = '|';
-        screen_buffer[i][chip8_display_width+1] = '|';
+        __m128i bytes = _mm_set_epi64x(((row >> 48) & 0xFF) * glyph_spread, (row >> 56) * glyph_spread);
+        __m128i on = _mm_cmpeq_epi8(_mm_and_si128(bytes, bits), bits);
+        _mm_storeu_si128((__m128i *)(out + 16 * i), _mm_xor_si128(off, _mm_and_si128(on, flip)));
     }
-    // bottom border
-    screen_buffer[chip8_display_height+1][0] = '\\';
-    for (int i = 1; i <= chip8_display_width; ++i)
-      screen_buffer[chip8_display_height+1][i] = '-';
-    screen_buffer[chip8_display_height+1][chip8_display_width+1] = '/';
 }
 
-void draw_display(chip8_t *c = &chip8)
+GLYPHS_AVX2 void expand_glyphs_avx2(char *out, uint64_t row)
 {
-    print_border();
+    const __m256i bits = _mm256_set1_epi64x(glyph_bits);
+    const __m256i off = _mm256_set1_epi8(PIXEL_OFF);
+    const __m256i flip = _mm256_set1_epi8(PIXEL_ON ^ PIXEL_OFF);
+    for (int i = 0; i < chip8_display_width / 32; ++i, row <<= 32)
+    {
+        __m256i bytes = _mm256_set_epi64x(((row >> 32) & 0xFF) * glyph_spread, ((row >> 40) & 0xFF) * glyph_spread,
+                                          ((row >> 48) & 0xFF) * glyph_spread, (row >> 56) * glyph_spread);
+        __m256i on = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits), bits);
+        _mm256_storeu_si256((__m256i *)(out + 32 * i), _mm256_xor_si256(off, _mm256_and_si256(on, flip)));
+    }
+}
 
-    for (int i = 0; i < chip8_display_height; ++i)
+// Whether both the CPU and the OS, which has to save the wider registers, support AVX2
+bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+    if (!osxsave || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#else
+    // we may be running before libgcc's own constructors did this
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+struct glyph_expander_t {
+    const char *name;
+    expand_glyphs_f *expand;
+    bool supported; // by the CPU we are running on
+};
+
+// Every implementation, fastest first
+const glyph_expander_t glyph_expanders[] = {
+#ifdef CHIPPERINO_GLYPHS_X86
+    { "avx2", expand_glyphs_avx2, cpu_has_avx2() },
+    { "sse2", expand_glyphs_sse2, true }, // part of x86-64 itself
+#endif
+    { "scalar", expand_glyphs_scalar, true },
+};
+
+expand_glyphs_f *select_glyph_expander()
+{
+    for (const glyph_expander_t &g : glyph_expanders)
+        if (g.supported)
+            return g.expand;
+    return expand_glyphs_scalar;
+}
+
+expand_glyphs_f *expand_glyphs = select_glyph_expander();
+
+/** Frames **/
+
+/* The terminal keeps whatever we drew last, so instead of redrawing the whole frame we remember what is on
+   screen and only send the cells that changed: a cursor move followed by the glyphs of each changed run. When
+   that takes more bytes than the whole frame would, we send the whole frame: a template with the border
+   already in place and every row of glyphs expanded straight into its slot */
+
+// Unchanged cells between two changed ones that we would rather reprint than pay another cursor move for
+const int screen_min_gap = 6;
+
+// A whole frame is the cursor going home, then the border and the display, each line "|<glyphs>|\n"
+const size_t frame_line_size = chip8_display_width + 3;
+const size_t frame_header_size = sizeof(RESET_CURSOR) - 1;
+const size_t frame_size = frame_header_size + (chip8_display_height + 2) * frame_line_size;
+
+// Where the glyphs of row y go in a whole frame
+size_t frame_row_offset(int y)
+{
+    return frame_header_size + (y + 1) * frame_line_size + 1;
+}
+
+struct screen_t {
+    // what the terminal is showing right now, in the same packed form as chip8_t::display
+    uint64_t presented[chip8_display_height];
+    // a row with the most runs possible needs less than two bytes per cell, and the border frame fits too
+    char out[chip8_display_height * chip8_display_width * 2 + 64];
+    // the border of a whole frame, with its rows left for the glyphs
+    char frame[frame_size];
+    bool frame_ready = false;
+};
+
+static_assert(sizeof(RESET_SCREEN) - 1 + frame_size <= sizeof(screen_t::out));
+
+screen_t screen;
+
+void build_frame_template(screen_t *s)
+{
+    char *p = s->frame;
+    memcpy(p, RESET_CURSOR, frame_header_size);
+    p += frame_header_size;
+    for (int line = 0; line < chip8_display_height + 2; ++line)
+    {
+        bool border = line == 0 || line == chip8_display_height + 1;
+        *p++ = line == 0 ? '/' : border ? '\\' : '|';
+        memset(p, border ? '-' : PIXEL_OFF, chip8_display_width);
+        p += chip8_display_width;
+        *p++ = line == 0 ? '\\' : border ? '/' : '|';
+        *p++ = '\n';
+    }
+    s->frame_ready = true;
+}
+
+// Write into out, which must hold frame_size bytes, the whole frame for the given rows, and take them as presented
+void fill_frame(char *out, const uint64_t *rows, screen_t *s)
+{
+    if (!s->frame_ready)
+        build_frame_template(s);
+    memcpy(out, s->frame, frame_size);
+    for (int y = 0; y < chip8_display_height; ++y)
+    {
+        expand_glyphs(out + frame_row_offset(y), rows[y]);
+        s->presented[y] = rows[y];
+    }
+}
+
+// Clear the terminal and draw the border and an empty display, all in a single write
+void print_border(screen_t *s = &screen)
+{
+    const uint64_t empty[chip8_display_height] = {};
+    size_t n = sizeof(RESET_SCREEN) - 1;
+    memcpy(s->out, RESET_SCREEN, n);
+    fill_frame(s->out + n, empty, s);
+
+    fflush(stdout); // anything stdio still holds must land before us
+    write_raw_output(s->out, n + frame_size);
+}
+
+/* Build into s->out what brings the terminal up to date with the given packed rows, and take them as presented.
+   Returns the number of bytes to write */
+size_t encode_frame(const uint64_t *rows, screen_t *s = &screen)
+{
+    char *p = s->out;
+    char glyphs[chip8_display_width];
+
+    for (int y = 0; y < chip8_display_height; ++y)
     {
-        for (int j = 0; j < chip8_display_width; ++j)
+        uint64_t changed = s->presented[y] ^ rows[y];
+        if (!changed)
+            continue;
+        expand_glyphs(glyphs, rows[y]);
+
+        int x = 0;
+        while (x < chip8_display_width)
         {
-            char glyph = c->display[i][j] ? '*' : ' ';
-            screen_buffer[i+1][j+1] = glyph;
+            if (!((changed << x) >> 63))
+            {
+                ++x;
+                continue;
+            }
+
+            // stretch the run over short unchanged gaps
+            int start = x, end = x + 1;
+            for (x = end; x < chip8_display_width && x - end < screen_min_gap; ++x)
+                if ((changed << x) >> 63)
+                    end = x + 1;
+            x = end;
+
+            // the display starts at row 2, column 2 of the terminal, inside the border
+            p += sprintf(p, "\033[%d;%dH", y + 2, start + 2);
+            memcpy(p, glyphs + start, end - start);
+            p += end - start;
         }
+        s->presented[y] = rows[y];
+    }
+
+    if ((size_t)(p - s->out) > frame_size)
+    {
+        fill_frame(s->out, rows, s);
+        return frame_size;
     }
+    return p - s->out;
+}
 
-    // Put newlines just so we can print everything just in a single printf call
-    for (int i = 0; i < chip8_display_height+1; ++i)
-      screen_buffer[i][chip8_display_width+2] = '\n';
+// Bring the terminal up to date with the given packed rows
+void present_frame(const uint64_t *rows, screen_t *s = &screen)
+{
+    size_t n = encode_frame(rows, s);
+    if (n)
+        write_raw_output(s->out, n);
+}
 
-    // And the null terminator for the right bottom corner
-    screen_buffer[chip8_display_height+1][chip8_display_width+2] = '\0';
+// Replace the status line under the border with the given text
+void present_status(const char *text, screen_t *s = &screen)
+{
+    int n = snprintf(s->out, sizeof(s->out), "\033[%d;1H%s\033[K", chip8_display_height + 3, text);
+    write_raw_output(s->out, std::min<size_t>(n, sizeof(s->out) - 1));
+}
 
-    // finally, the actual printing to screen
-    printf(RESET_CURSOR "%s", &screen_buffer[0][0]);
+void draw_display(chip8_t *c)
+{
+    present_frame(c->display);
 }
 
 void clear_screen()
@@ -0,0 +1,230 @@
+#ifndef CHIPPERINO_THREADED_H
+#define CHIPPERINO_THREADED_H
+
+#include "architecture.hpp"
+#include "dispatch.hpp"
+
+/* Threaded-code engine. Instead of coming back to a single switch after every instruction, each handler
+   jumps straight into the handler of the next one, so the host branch predictor gets one indirect branch
+   per handler to learn the guest's instruction sequences from. Same handlers and stop rules as run_switch() */
+
+#if defined(__has_attribute) && !defined(CHIPPERINO_MUSTTAIL)
+#if __has_attribute(musttail)
+#define CHIPPERINO_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#if defined(__GNUC__) && !defined(CHIPPERINO_NO_COMPUTED_GOTO)
+
+// GCC and Clang let us take the address of a label and jump to it ("computed goto")
+uint32_t run_threaded(chip8_t *c, uint32_t budget)
+{
+    // NOTE: must be kept in the same order as chip8_op_t
+    static void *const handlers[] = {
+        &&op_undecoded,
+        &&op_cls, &&op_ret, &&op_sys, &&op_jp, &&op_call,
+        &&op_se_byte, &&op_sne_byte, &&op_se_reg, &&op_ld_byte, &&op_add_byte,
+        &&op_ld_reg, &&op_or, &&op_and, &&op_xor, &&op_add_reg, &&op_sub, &&op_shr, &&op_subn, &&op_shl,
+        &&op_sne_reg, &&op_ld_i, &&op_jp_v0, &&op_rnd, &&op_drw, &&op_skp, &&op_sknp,
+        &&op_ld_vx_dt, &&op_ld_vx_k, &&op_ld_dt_vx, &&op_ld_st_vx, &&op_add_i_vx, &&op_ld_f_vx,
+        &&op_ld_b_vx, &&op_ld_mem_vx, &&op_ld_vx_mem,
+        &&op_error,
+    };
+    static_assert(sizeof(handlers)/sizeof(handlers[0]) == OP_COUNT);
+
+    uint32_t executed = 0;
+    uint16_t pc;
+    chip8_decoded_t d;
+
+#define NEXT()                                  \
+    do {                                        \
+        if (executed == budget)                 \
+            return executed;                    \
+        pc = c->pc;                             \
+        d = *fetch_decoded(c, pc);              \
+        c->pc += 2;                             \
+        ++executed;                             \
+        goto *handlers[d.op];                   \
+    } while (0)
+
+    NEXT();
+
+op_cls:       op_cls(c, d);       NEXT();
+op_ret:       op_ret(c, d);       NEXT();
+op_sys:       op_sys(c, d);       NEXT();
+op_call:      op_call(c, d);      NEXT();
+op_se_byte:   op_se_byte(c, d);   NEXT();
+op_sne_byte:  op_sne_byte(c, d);  NEXT();
+op_se_reg:    op_se_reg(c, d);    NEXT();
+op_ld_byte:   op_ld_byte(c, d);   NEXT();
+op_add_byte:  op_add_byte(c, d);  NEXT();
+op_ld_reg:    op_ld_reg(c, d);    NEXT();
+op_or:        op_or(c, d);        NEXT();
+op_and:       op_and(c, d);       NEXT();
+op_xor:       op_xor(c, d);       NEXT();
+op_add_reg:   op_add_reg(c, d);   NEXT();
+op_sub:       op_sub(c, d);       NEXT();
+op_shr:       op_shr(c, d);       NEXT();
+op_subn:      op_subn(c, d);      NEXT();
+op_shl:       op_shl(c, d);       NEXT();
+op_sne_reg:   op_sne_reg(c, d);   NEXT();
+op_ld_i:      op_ld_i(c, d);      NEXT();
+op_jp_v0:     op_jp_v0(c, d);     NEXT();
+op_rnd:       op_rnd(c, d);       NEXT();
+op_skp:       op_skp(c, d);       NEXT();
+op_sknp:      op_sknp(c, d);      NEXT();
+op_ld_vx_dt:  op_ld_vx_dt(c, d);  NEXT();
+op_ld_dt_vx:  op_ld_dt_vx(c, d);  NEXT();
+op_ld_st_vx:  op_ld_st_vx(c, d);  NEXT();
+op_add_i_vx:  op_add_i_vx(c, d);  NEXT();
+op_ld_f_vx:   op_ld_f_vx(c, d);   NEXT();
+op_ld_b_vx:   op_ld_b_vx(c, d);   NEXT();
+op_ld_mem_vx: op_ld_mem_vx(c, d); NEXT();
+op_ld_vx_mem: op_ld_vx_mem(c, d); NEXT();
+
+op_drw:
+    op_drw(c, d);
+    // give the caller a chance to present the frame
+    return executed;
+
+op_ld_vx_k:
+    op_ld_vx_k(c, d);
+    if (c->pc == pc) // still waiting for a key
+        return executed;
+    NEXT();
+
+op_jp:
+    op_jp(c, d);
+    if (idle_state(c)) // only waiting, let the caller skip ahead
+        return executed;
+    NEXT();
+
+op_undecoded: // fetch_decoded() never hands these out
+op_error:
+    NEXT();
+
+#undef NEXT
+}
+
+#elif defined(CHIPPERINO_MUSTTAIL)
+
+/* Without computed goto, every handler is its own function that ends by tail-calling the handler of the next
+   instruction. musttail guarantees those calls become jumps, so the stack does not grow with the budget */
+typedef uint32_t tail_handler_f(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed);
+extern tail_handler_f *const tail_handlers[OP_COUNT];
+
+#define TAIL_NEXT()                                                                 \
+    do {                                                                            \
+        if (executed == budget)                                                     \
+            return executed;                                                        \
+        chip8_decoded_t next = *fetch_decoded(c, c->pc);                            \
+        c->pc += 2;                                                                 \
+        CHIPPERINO_MUSTTAIL return tail_handlers[next.op](c, next, budget, executed + 1); \
+    } while (0)
+
+#define TAIL_HANDLER(name)                                                          \
+    uint32_t tail_##name(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed) \
+    {                                                                               \
+        name(c, d);                                                                 \
+        TAIL_NEXT();                                                                \
+    }
+
+TAIL_HANDLER(op_cls)
+TAIL_HANDLER(op_ret)
+TAIL_HANDLER(op_sys)
+TAIL_HANDLER(op_call)
+TAIL_HANDLER(op_se_byte)
+TAIL_HANDLER(op_sne_byte)
+TAIL_HANDLER(op_se_reg)
+TAIL_HANDLER(op_ld_byte)
+TAIL_HANDLER(op_add_byte)
+TAIL_HANDLER(op_ld_reg)
+TAIL_HANDLER(op_or)
+TAIL_HANDLER(op_and)
+TAIL_HANDLER(op_xor)
+TAIL_HANDLER(op_add_reg)
+TAIL_HANDLER(op_sub)
+TAIL_HANDLER(op_shr)
+TAIL_HANDLER(op_subn)
+TAIL_HANDLER(op_shl)
+TAIL_HANDLER(op_sne_reg)
+TAIL_HANDLER(op_ld_i)
+TAIL_HANDLER(op_jp_v0)
+TAIL_HANDLER(op_rnd)
+TAIL_HANDLER(op_skp)
+TAIL_HANDLER(op_sknp)
+TAIL_HANDLER(op_ld_vx_dt)
+TAIL_HANDLER(op_ld_dt_vx)
+TAIL_HANDLER(op_ld_st_vx)
+TAIL_HANDLER(op_add_i_vx)
+TAIL_HANDLER(op_ld_f_vx)
+TAIL_HANDLER(op_ld_b_vx)
+TAIL_HANDLER(op_ld_mem_vx)
+TAIL_HANDLER(op_ld_vx_mem)
+
+uint32_t tail_op_drw(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed)
+{
+    op_drw(c, d);
+    // give the caller a chance to present the frame
+    return executed;
+}
+
+uint32_t tail_op_ld_vx_k(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed)
+{
+    uint16_t pc = c->pc - 2;
+    op_ld_vx_k(c, d);
+    if (c->pc == pc) // still waiting for a key
+        return executed;
+    TAIL_NEXT();
+}
+
+uint32_t tail_op_jp(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed)
+{
+    op_jp(c, d);
+    if (idle_state(c)) // only waiting, let the caller skip ahead
+        return executed;
+    TAIL_NEXT();
+}
+
+uint32_t tail_op_error(chip8_t *c, chip8_decoded_t d, uint32_t budget, uint32_t executed)
+{
+    TAIL_NEXT();
+}
+
+// NOTE: must be kept in the same order as chip8_op_t
+tail_handler_f *const tail_handlers[OP_COUNT] = {
+    tail_op_error, // OP_UNDECODED, fetch_decoded() never hands these out
+    tail_op_cls, tail_op_ret, tail_op_sys, tail_op_jp, tail_op_call,
+    tail_op_se_byte, tail_op_sne_byte, tail_op_se_reg, tail_op_ld_byte, tail_op_add_byte,
+    tail_op_ld_reg, tail_op_or, tail_op_and, tail_op_xor, tail_op_add_reg, tail_op_sub, tail_op_shr,
+    tail_op_subn, tail_op_shl,
+    tail_op_sne_reg, tail_op_ld_i, tail_op_jp_v0, tail_op_rnd, tail_op_drw, tail_op_skp, tail_op_sknp,
+    tail_op_ld_vx_dt, tail_op_ld_vx_k, tail_op_ld_dt_vx, tail_op_ld_st_vx, tail_op_add_i_vx, tail_op_ld_f_vx,
+    tail_op_ld_b_vx, tail_op_ld_mem_vx, tail_op_ld_vx_mem,
+    tail_op_error,
+};
+
+#undef TAIL_HANDLER
+#undef TAIL_NEXT
+
+uint32_t run_threaded(chip8_t *c, uint32_t budget)
+{
+    if (!budget)
+        return 0;
+
+    chip8_decoded_t d = *fetch_decoded(c, c->pc);
+    c->pc += 2;
+    return tail_handlers[d.op](c, d, budget, 1);
+}
+
+#else
+
+// No way of threading handlers on this compiler, fall back to the reference engine
+uint32_t run_threaded(chip8_t *c, uint32_t budget)
+{
+    return run_switch(c, budget);
+}
+
+#endif
+
+#endif
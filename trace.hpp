@@ -0,0 +1,311 @@
+#ifndef CHIPPERINO_TRACE_H
+#define CHIPPERINO_TRACE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "architecture.hpp"
+#include "utils.hpp"
+#include "opcodes.hpp"
+#include "dispatch.hpp"
+#include "savestate.hpp"
+#include "disassembler.hpp"
+
+/* Execution traces: one fixed size record per instruction run, written by run_traced() into a ring owned by
+   its thread. A single writer thread drains every ring into its file, so the traced thread never formats or
+   writes anything itself, it only stores 16 bytes and bumps a counter. When the writer falls a whole ring
+   behind the traced thread waits for it, a trace with holes in it would not be much of a trace.
+
+   Files are a header (magic "CH8T", u16 version, u16 record size) and then the records, little endian:
+
+       u64 cycle, u16 pc, u16 instruction, u16 I, u8 Vx, u8 VF
+
+   with cycle the machine's clock (chip8_t::cycles) when the instruction started, and registers and I as they
+   were after it. Which register Vx is, and whether it or VF were
+   written at all, follows from the instruction, see trace_writes_vx() and trace_writes_vf() */
+
+const char trace_magic[4] = { 'C', 'H', '8', 'T' };
+const uint16_t trace_version = 1;
+const size_t trace_header_size = 4 + 2 + 2;
+const size_t trace_record_size = 8 + 2 + 2 + 2 + 1 + 1;
+
+struct trace_record_t {
+    uint64_t cycle;
+    uint16_t pc;
+    uint16_t instruction;
+    uint16_t I;
+    uint8_t vx;
+    uint8_t vf;
+};
+
+// Records per ring, a power of two. 1 MB, a few ms worth of instructions at full speed
+const uint64_t trace_ring_records = 1 << 16;
+// How long the writer sleeps when it finds every ring empty
+auto trace_polling_period = std::chrono::milliseconds(1);
+
+struct trace_ring_t {
+    trace_record_t records[trace_ring_records];
+    std::atomic<uint64_t> head{0}; // records pushed, only written by the traced thread
+    std::atomic<uint64_t> tail{0}; // records written out, only written by the writer
+    uint64_t free_until = 0;       // head can go up to here before the traced thread has to look at tail again
+    FILE *file = NULL;
+    bool failed = false;           // the writer could not write something, set before it moves tail
+};
+
+struct trace_writer_t {
+    std::mutex lock; // guards rings, held while draining them
+    std::vector<trace_ring_t *> rings;
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+trace_writer_t trace_writer;
+// The ring run_traced() pushes into, on this thread
+thread_local trace_ring_t *trace_context = NULL;
+
+bool trace_writes_vx(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_LD_BYTE: case OP_ADD_BYTE: case OP_LD_REG: case OP_OR: case OP_AND: case OP_XOR: case OP_ADD_REG:
+    case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL: case OP_RND: case OP_LD_VX_DT: case OP_LD_VX_K:
+    case OP_LD_VX_MEM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool trace_writes_vf(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD_REG: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL: case OP_DRW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/** Writer side **/
+
+// Write out whatever r holds. Returns the number of records written
+uint64_t drain_trace(trace_ring_t *r, uint8_t *buffer)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    // acquire so the records before head are all there
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    uint8_t *p = buffer;
+    for (uint64_t i = tail; i < head; ++i)
+    {
+        const trace_record_t *record = &r->records[i & (trace_ring_records - 1)];
+        p = put_u64(p, record->cycle);
+        p = put_u16(p, record->pc);
+        p = put_u16(p, record->instruction);
+        p = put_u16(p, record->I);
+        *p++ = record->vx;
+        *p++ = record->vf;
+    }
+    if (p != buffer && fwrite(buffer, 1, p - buffer, r->file) != (size_t)(p - buffer))
+        r->failed = true;
+    // release so the traced thread does not overwrite records before we are done with them
+    r->tail.store(head, std::memory_order_release);
+    return head - tail;
+}
+
+void trace_write_loop(trace_writer_t *w)
+{
+    std::vector<uint8_t> buffer(trace_ring_records * trace_record_size);
+    while (w->running.load(std::memory_order_relaxed))
+    {
+        uint64_t written = 0;
+        {
+            std::lock_guard<std::mutex> lock(w->lock);
+            for (trace_ring_t *r : w->rings)
+                written += drain_trace(r, buffer.data());
+        }
+        if (!written)
+            std::this_thread::sleep_for(trace_polling_period);
+    }
+}
+
+void start_trace_writer(trace_writer_t *w = &trace_writer)
+{
+    w->running = true;
+    w->thread = std::thread(trace_write_loop, w);
+}
+
+// Every ring has to be stopped first, anything still in them would be lost
+void stop_trace_writer(trace_writer_t *w = &trace_writer)
+{
+    w->running = false;
+    if (w->thread.joinable())
+        w->thread.join();
+}
+
+/** Traced side **/
+
+/* Start tracing into a new file at filename through r, which must not be in use. Returns 0 on success, -1 with
+   errno set otherwise */
+int start_trace(trace_ring_t *r, const char *filename, trace_writer_t *w = &trace_writer)
+{
+    r->file = fopen(filename, "wb");
+    if (!r->file)
+        return -1;
+    uint8_t header[trace_header_size];
+    uint8_t *p = header;
+    memcpy(p, trace_magic, sizeof(trace_magic));
+    p += sizeof(trace_magic);
+    p = put_u16(p, trace_version);
+    p = put_u16(p, trace_record_size);
+    if (fwrite(header, 1, sizeof(header), r->file) != sizeof(header))
+    {
+        int error = errno;
+        fclose(r->file);
+        r->file = NULL;
+        errno = error;
+        return -1;
+    }
+
+    r->failed = false;
+    r->free_until = r->tail.load(std::memory_order_relaxed) + trace_ring_records;
+    std::lock_guard<std::mutex> lock(w->lock);
+    w->rings.push_back(r);
+    return 0;
+}
+
+/* Wait for the writer to take everything in r and close its file. Returns 0 if the whole trace made it to disk,
+   -1 with errno set otherwise */
+int stop_trace(trace_ring_t *r, trace_writer_t *w = &trace_writer)
+{
+    while (r->tail.load(std::memory_order_acquire) != r->head.load(std::memory_order_relaxed))
+        std::this_thread::sleep_for(trace_polling_period);
+    {
+        std::lock_guard<std::mutex> lock(w->lock);
+        w->rings.erase(std::find(w->rings.begin(), w->rings.end(), r));
+    }
+    bool failed = r->failed;
+    // whatever went wrong on the writer's side left its errno there
+    int error = EIO;
+    if (fclose(r->file))
+        failed = true, error = errno;
+    r->file = NULL;
+    errno = error;
+    return failed ? -1 : 0;
+}
+
+void push_trace(trace_ring_t *r, const trace_record_t &record)
+{
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    while (head == r->free_until)
+    {
+        // acquire so the writer is done with the records we are about to overwrite
+        r->free_until = r->tail.load(std::memory_order_acquire) + trace_ring_records;
+        if (head == r->free_until)
+            std::this_thread::yield();
+    }
+    r->records[head & (trace_ring_records - 1)] = record;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+/* run_switch() with a record of every instruction pushed into trace_context. Like every engine it leaves the
+   clock to its caller, which has it at the start of the run */
+uint32_t run_traced(chip8_t *c, uint32_t budget)
+{
+    trace_ring_t *r = trace_context;
+    uint32_t executed = 0;
+    while (executed < budget)
+    {
+        uint16_t pc = c->pc;
+        const chip8_decoded_t d = *fetch_decoded(c, pc);
+        // as it was run, the instruction may write over itself
+        uint16_t instruction = pc < memory_size - 1 ? (c->raw_memory[pc] << 8) | c->raw_memory[pc + 1] : 0;
+
+        uint64_t cycle = c->cycles + executed;
+        dispatch(c);
+        ++executed;
+        push_trace(r, { cycle, pc, instruction, c->I, (uint8_t)c->regs[d.x], (uint8_t)c->VF });
+
+        if (engine_stops_after(c, d.op, pc))
+            break;
+    }
+    return executed;
+}
+
+/** Trace decoder **/
+
+// Read the record at p, which must hold trace_record_size bytes
+void get_trace_record(const uint8_t *p, trace_record_t *record)
+{
+    p = get_u64(p, &record->cycle);
+    p = get_u16(p, &record->pc);
+    p = get_u16(p, &record->instruction);
+    p = get_u16(p, &record->I);
+    record->vx = p[0];
+    record->vf = p[1];
+}
+
+// One line per record: cycle, the instruction like in a listing and what it left in the registers it wrote
+void format_trace_record(char *out, size_t n, const trace_record_t *record)
+{
+    chip8_instruction_t i = { { { (uint8_t)(record->instruction >> 8), (uint8_t)record->instruction } } };
+    uint8_t op = find_opcode(record->instruction)->op;
+    char line[64], vx[8] = "", vf[8] = "";
+    format_instruction(line, sizeof(line), i, record->pc);
+    if (trace_writes_vx(op))
+        snprintf(vx, sizeof(vx), "V%X=%02X ", HALF_LOWER_BYTE(i.msb), record->vx);
+    if (trace_writes_vf(op))
+        snprintf(vf, sizeof(vf), "VF=%02X ", record->vf);
+    snprintf(out, n, "%llu\t%s\t%s%sI=%03X", (unsigned long long)record->cycle, line, vx, vf, record->I);
+}
+
+// Print the trace in filename through the disassembler. Returns 0 on success, 1 otherwise
+int print_trace(const char *filename)
+{
+    mapped_file_t f;
+    if (map_file(&f, filename))
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    uint16_t version = 0, record_size = 0;
+    if (f.size >= trace_header_size && !memcmp(f.data, trace_magic, sizeof(trace_magic)))
+    {
+        get_u16(f.data + sizeof(trace_magic), &version);
+        get_u16(f.data + sizeof(trace_magic) + 2, &record_size);
+    }
+    if (version != trace_version || record_size != trace_record_size)
+    {
+        fprintf(stderr, "'%s' is not a trace we can read\n", filename);
+        unmap_file(&f);
+        return 1;
+    }
+
+    printf("Trace:\n================\n");
+    printf("%s\t%s\t%s\t%-18s%s\t%s\n", "CYCLE", "ADDR", "INST", "PARAMS", "MNEMONIC", "WRITES");
+    size_t count = (f.size - trace_header_size) / trace_record_size;
+    for (size_t n = 0; n < count; ++n)
+    {
+        trace_record_t record;
+        get_trace_record(f.data + trace_header_size + n * trace_record_size, &record);
+
+        char line[128];
+        format_trace_record(line, sizeof(line), &record);
+        printf("%s\n", line);
+    }
+    if ((f.size - trace_header_size) % trace_record_size)
+        fprintf(stderr, "'%s' ends in the middle of a record, it was cut short\n", filename);
+    printf("================\nend of trace\n");
+    unmap_file(&f);
+    return 0;
+}
+
+#endif
@@ -1,15 +1,30 @@
 #ifndef CHIPPERINO_UTILS_H
 #define CHIPPERINO_UTILS_H
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
 bool colored_display;
 
+// A whole file mapped read only into memory, see map_file()
+struct mapped_file_t {
+    const uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    void *mapping;
+#endif
+};
+
 #ifdef __linux__
 #include <unistd.h>
 #include <termios.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 bool check_for_terminal()
 {
@@ -90,6 +105,76 @@ bool read_raw_input(char *c, int n, int fd = STDIN_FILENO)
     }
 }
 
+/* Block until there is input to read or timeout_ns go by, forever if timeout_ns is negative. Returns whether
+   there is input */
+bool wait_for_input(int64_t timeout_ns = -1, int fd = STDIN_FILENO)
+{
+    struct pollfd p = { fd, POLLIN, 0 };
+    struct timespec ts = { (time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000) };
+    int ret;
+    while ((ret = ppoll(&p, 1, timeout_ns < 0 ? NULL : &ts, NULL)) < 0 && errno == EINTR)
+        ;
+    return ret > 0;
+}
+
+// Write the whole buffer with as few syscalls as the kernel allows, bypassing stdio's buffering
+bool write_raw_output(const char *buf, size_t n, int fd = STDOUT_FILENO)
+{
+    while (n)
+    {
+        ssize_t ret = write(fd, buf, n);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+/* Map filename into memory instead of reading it, which saves a copy and, for many small files, most of the
+   system calls. Returns 0 on success, -1 with errno set otherwise */
+int map_file(mapped_file_t *f, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return -1;
+    }
+
+    f->size = st.st_size;
+    f->data = NULL;
+    // empty files cannot be mapped, and there is nothing to map anyway
+    if (f->size)
+    {
+        void *p = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        f->data = (const uint8_t *)p;
+    }
+    // the mapping keeps the file alive on its own
+    close(fd);
+    return 0;
+}
+
+void unmap_file(mapped_file_t *f)
+{
+    if (f->data)
+        munmap((void *)f->data, f->size);
+    f->data = NULL;
+    f->size = 0;
+}
+
 #else
 #ifdef _WIN32
 #include <io.h>
@@ -143,6 +228,26 @@ void set_console_raw_mode(bool state, int fd = STD_INPUT_HANDLE)
     }
 }
 
+bool write_raw_output(const char *buf, size_t n, int fd = _fileno(stdout))
+{
+    while (n)
+    {
+        int ret = _write(fd, buf, (unsigned)n);
+        if (ret < 0)
+            return false;
+        buf += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+bool wait_for_input(int64_t timeout_ns = -1, int fd = STD_INPUT_HANDLE)
+{
+    HANDLE console_handle = GetStdHandle(fd);
+    DWORD timeout_ms = timeout_ns < 0 ? INFINITE : (DWORD)((timeout_ns + 999999) / 1000000);
+    return WaitForSingleObject(console_handle, timeout_ms) == WAIT_OBJECT_0;
+}
+
 bool read_raw_input(char *c, int n, int fd = STD_INPUT_HANDLE)
 {
     HANDLE console_handle = GetStdHandle(fd);
@@ -184,6 +289,53 @@ bool read_raw_input(char *c, int n, int fd = STD_INPUT_HANDLE)
     //     return false;
     // }
 }
+int map_file(mapped_file_t *f, const char *filename)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        errno = EIO;
+        return -1;
+    }
+
+    f->size = (size_t)size.QuadPart;
+    f->data = NULL;
+    f->mapping = NULL;
+    if (f->size)
+    {
+        f->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (f->mapping)
+            f->data = (const uint8_t *)MapViewOfFile(f->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!f->data)
+        {
+            if (f->mapping)
+                CloseHandle(f->mapping);
+            CloseHandle(file);
+            errno = EIO;
+            return -1;
+        }
+    }
+    CloseHandle(file);
+    return 0;
+}
+
+void unmap_file(mapped_file_t *f)
+{
+    if (f->data)
+    {
+        UnmapViewOfFile(f->data);
+        CloseHandle(f->mapping);
+    }
+    f->data = NULL;
+    f->size = 0;
+}
 #endif
 #endif
 